@@ -10,10 +10,13 @@
  *
  * The allocated blocks are traversed using an implicit list. The header and 
  * footer for each block use only 4 bytes each and are packed within a single 
- * word. Thus, one word aligned to 8 bytes contains the header for the current 
- * block and the footer for the previous block. Within this, the footer is 
- * aligned to 4 bytes. The least significant bit of the header and footer 
- * are used to store the allocation bit.
+ * word. Thus, one word aligned to 8 bytes contains the footer for the
+ * previous block followed by the header for the current block. The least
+ * significant bit of the header and footer are used to store the allocation
+ * bit. Only free blocks have a footer. The third bit of every header records
+ * whether the previous block is allocated, so coalesce only reads a footer
+ * when there is one, and an allocated block's payload runs up to the next
+ * header. That leaves 4 bytes of overhead per allocated block.
  *
  * The free blocks are managed using segregated free lists. 11 free lists 
  * each represent a range of blocks lying within succesive powers of 2, 
@@ -21,23 +24,210 @@
  * 2^7, the next contains 2^7 and 2^8 ... the final list contains free blocks
  * sized between 2^17 to infinity (or 2^32). Each free block has a next pointer
  * and a previous pointer. These are stored as offsets to the start of the heap
- * and are thus both packed into a single word. Each list is searched using a
- * first fit algorithm, however the largest size bin list is searched using a
- * best fit algorithm.
+ * and are thus both packed into a single word. The offsets count 8 byte
+ * granules rather than bytes, so a heap may span up to MAX_SPAN (32GB).
+ * Block sizes are kept in bytes next to the flag bits of the 4 byte header, so
+ * a single block is limited to MAX_BLOCK (just under 4GB). Larger requests are
+ * mapped on their own, coalescing stops short of MAX_BLOCK, and requests or
+ * heap growth past either limit fail with ENOMEM. Each list is searched using
+ * a first fit algorithm, however the largest size bin is searched using a best
+ * fit algorithm. To keep that search short the largest bin is not a list but a
+ * treap ordered by block size and then address. Its nodes reuse the same
+ * packed word, the previous and next offsets holding the left and right
+ * children, and node priorities are a hash of the block address so no extra
+ * space is needed.
+ *
+ * The placement and the order of the lists can be changed for each heap
+ * with mm_set_policy before mm_init. Placement is first fit by default, or
+ * next fit, which resumes each list where its last search stopped, best fit
+ * or good fit, which settles for a block that wastes at most 1/GOOD_SLACK
+ * of itself or for the best of the first GOOD_STEPS blocks that fit. Free
+ * blocks go to the front of their list by default, or are kept in address
+ * order at the cost of a list walk. The treap is always searched best fit.
+ *
+ * When compiled with -DTLSF the 11 bins are replaced by a two level
+ * segregated fit. The first level splits sizes into powers of 2 and the
+ * second level splits each of those linearly into SL_COUNT lists. Bitmaps
+ * of the non empty lists at both levels let find_fit locate a suitable list
+ * with two bit scans, so malloc and free take constant time regardless of
+ * list lengths. Only the final list is searched with the placement policy,
+ * the head of any other list found this way fits.
+ *
+ * Requests of up to SLAB_MAX bytes do not get a block of their own. They
+ * are carved out of slabs: SLAB_SIZE aligned runs taken from the heap as
+ * single allocated blocks, each holding objects of one size class with no
+ * per object header. A bitmap in the slab header records the free objects,
+ * and a page map indexed by heap offset tells free() which pointers belong
+ * to a slab.
+ *
+ * Each thread keeps a small cache of recently freed blocks for every payload
+ * size up to CACHE_MAX. Blocks in a thread cache stay marked as allocated in
+ * the heap and are linked through their first payload word. A cache is
+ * refilled from, and flushed back to, the shared segregated lists in batches
+ * of CACHE_BATCH blocks, so only those batch operations and the larger
+ * requests need to take the heap lock.
+ *
+ * A free that would have to wait for the heap lock does not. free and the
+ * thread cache flushes only try the lock, and when it is taken they push
+ * their blocks onto remote_inbox, a lock free stack linked like the thread
+ * caches. Any thread may push, only the holder of the heap lock pops, and
+ * it takes the whole stack at once. Every acquisition of the heap lock
+ * (HEAP_LOCK) first drains the inbox into the heap, so blocks freed by
+ * other threads are coalesced in batches by the next thread to allocate.
+ *
+ * The shared heap keeps fast bins of its own for blocks of up to FAST_MAX
+ * bytes, which covers the thread cache flushes and the small requests that
+ * skip the caches. heap_free pushes such blocks onto the fast bin of their
+ * exact size, still marked as allocated, and heap_malloc takes them back
+ * without a search, a split or a coalesce. The fast bins are consolidated
+ * into the segregated lists once they hold FAST_LIMIT bytes, when a search
+ * of the lists fails and before the heap is trimmed.
+ *
+ * Requests of at least mmap_threshold bytes (MMAP_THRESHOLD by default, see
+ * mm_set_mmap_threshold) bypass the heap entirely. Each gets its own
+ * anonymous mapping, with the mapping length stored in the word in front of
+ * the header and the MMAPPED bit set in the header. free() unmaps them and
+ * realloc() resizes them with mremap, so they never fragment or pin the
+ * heap. A mapped chunk with a larger alignment starts at the page holding
+ * its length word, the pages in front of that are unmapped.
+ *
+ * memalign, posix_memalign and aligned_alloc search the free lists for a
+ * block with room for an aligned payload and a minimum sized block in front
+ * of it, split that leading block off as a free block and place the
+ * aligned block as usual, so nothing is over-allocated. Aligned blocks are
+ * ordinary blocks to free, realloc and the heap checker. Their payload
+ * keeps its alignment only as long as realloc does not move it.
+ *
+ * Free memory is handed back to the system by heap_trim, either explicitly
+ * through mm_trim or automatically once trim_threshold bytes have been freed
+ * while at least that much is free. The whole pages inside large free blocks
+ * are released with madvise(MADV_DONTNEED), leaving the block header, list
+ * word and footer in place. The header of a released block is marked, so a
+ * later trim skips it until the block is next allocated or coalesced and
+ * only counts the pages it newly releases. An automatic trim only marks the
+ * footer of a block that has become free since the previous trim, and
+ * releases it on the next one if it is still free then, so that blocks
+ * reused right away are not faulted in again. When built with -DHEAP_SHRINK,
+ * for a mem_sbrk that accepts negative increments, a free block at the top
+ * of the heap is cut back instead.
+ *
+ * The heap grows by more than a request needs once it is large. extend_heap
+ * grows it by grow_step, which doubles with every grow and halves with every
+ * trim, but never by more than 1/GROW_RATIO of the heap, so a small heap
+ * still grows a page at a time while a fast growing one makes few mem_sbrk
+ * calls. A free block at the top of the heap counts towards the request.
+ * Once the step reaches HUGE_SIZE (2MB) the heap grows to HUGE_SIZE
+ * boundaries, and every whole huge page inside the heap is marked with
+ * madvise(MADV_HUGEPAGE) so that the kernel can back it with a single TLB
+ * entry. Releasing pages in a free block splits its huge page again.
+ *
+ * mm_set_limit puts a soft limit on the heap and the mapped chunks. A grow
+ * is kept within it where possible. One that has to cross it first runs the
+ * pressure callbacks under the heap lock, where the blocks they free land in
+ * the inbox and the calling thread's cache. relieve_pressure then takes both
+ * back without trimming, since realloc may have the old block's contents in
+ * the free lists, and retries the fit before the heap grows anyway.
+ *
+ * mm_set_sample_rate turns on a sampling heap profiler. Each thread counts
+ * down the bytes it allocates over intervals drawn at random around the
+ * rate, and the allocation that crosses zero records its call stack with
+ * backtrace and is kept in a hash table of sampled blocks, weighted by the
+ * bytes its interval stood for. free looks the block up only if its hash
+ * chain is non empty. Samples are tallied per distinct stack, live and since
+ * the profiler started, and mm_profile_dump writes the tallies as a pprof
+ * heap profile or as folded stacks for flamegraph.pl. The profiler's records
+ * come from mappings of their own, so it never allocates from the heap it
+ * watches, and it takes no heap lock.
+ *
+ * mm_dump_layout walks the implicit list like the heap checker and streams
+ * a fixed size record for every block (see mm_ext.h), followed by records
+ * for the blocks that look allocated but sit in a fast bin or the caller's
+ * thread cache. mm_layout.c turns a dump into fragmentation figures.
+ *
+ * calloc only clears what may be dirty. Mapped chunks are always fresh. When
+ * built with -DHEAP_ZEROED, for a mem_sbrk that returns zero filled memory,
+ * fresh_mark tracks the end of the highest block ever handed out. Heap
+ * memory above it has only held allocator metadata, and the boundary words
+ * left inside a block by coalescing are cleared there, so a block from above
+ * fresh_mark only needs its first word and old footer cleared. Everything
+ * else is cleared with memset.
+ *
+ * Arenas (mm_arena_create) hand out memory for objects that are all freed
+ * together. They bump allocate out of ARENA_CHUNK sized chunks taken from
+ * the heap with malloc, keep no per object header, and free only their
+ * chunks on reset and destroy.
+ *
+ * Built with -DMM_PRELOAD, mm.c is a shared library that replaces the C
+ * library's allocator in any process it is preloaded into:
+ *
+ *   gcc -O2 -fno-builtin -fno-semantic-interposition -shared -fPIC \
+ *       -ftls-model=initial-exec -DMM_PRELOAD -o libmm.so mm.c -lpthread
+ *   LD_PRELOAD=./libmm.so ./proxy 8080
+ *
+ * -fno-builtin is required, without it gcc turns the malloc and memset in
+ * calloc into a call to calloc itself.
+ * The driver's memlib is replaced by the mem_* functions below, which grow
+ * and shrink the heap with the real sbrk. Fresh pages of the data segment
+ * are zero filled, so that build implies HEAP_SHRINK and HEAP_ZEROED. The
+ * heap is initialized by the first allocation, which also registers fork
+ * handlers that hold the heap lock across fork(). The child keeps the
+ * blocks cached by other threads of the parent allocated for good.
+ *
+ * mm_stats reports counters kept alongside all of the above. Counters for
+ * the shared heap live in stats and are only updated under the heap lock,
+ * the thread caches count their hits locally and fold them into stats when
+ * they next take the lock, and the mapped chunk and inbox counters are
+ * updated atomically.
  *
  * A heap checker for debugging purposes has been included at the end of the
  * file, followed by a set of helper functions. Please make sure to read where
  * the debugging function can be called effectively and where its return values
  * are undefined.
+ *
+ * Built with -DHEAP_CHECK, the heap is checked every time the heap lock is
+ * released (see mm_set_check). The full check walks the whole heap, the
+ * incremental one only checks the blocks in a small dirty set: place,
+ * resize_in_place and lifo_insert, which every coalesce ends in, add the
+ * blocks they touch and blocks that are merged away are dropped again. A
+ * sampled check only runs on a random one in check_one_in releases, and the
+ * dirty blocks of the releases in between are never checked.
  */
 
+#define _GNU_SOURCE
 #include <assert.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#ifdef MM_PRELOAD
+#include "mm_ext.h"
+#else
 #include "mm.h"
+#include "mm_ext.h"
 #include "memlib.h"
+#endif
+
+/* The preloaded library has neither the driver's headers nor its memlib,
+ * and the real sbrk shrinks on negative increments and hands out zero
+ * filled pages */
+#ifdef MM_PRELOAD
+int mm_init(void);
+void mm_checkheap(int lineno);
+static void *mem_sbrk(intptr_t incr);
+static void *mem_heap_lo(void);
+static void *mem_heap_hi(void);
+static size_t mem_heapsize(void);
+#define HEAP_SHRINK
+#define HEAP_ZEROED
+#endif
 
 /* If you want debugging output, use the following macro.  When you hand
  * in, remove the #define DEBUG line. */
@@ -56,16 +246,100 @@
 #define calloc mm_calloc
 #endif /* def DRIVER */
 
+/* aliases for the aligned allocation entry points, see mm_ext.h */
+#ifdef DRIVER
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
+#define malloc_usable_size mm_malloc_usable_size
+#endif
+
 /* Paramters  */
 #define WSIZE 8
 #define DWSIZE 16
+#define HSIZE 4
 #define MIN_SIZE 16
 #define PAGESIZE (1<<8)
 #define ALIGNMENT 8
+#ifdef TLSF
+/* Two level segregated fit parameters. First level lists are powers of 2
+ * from 2^FL_MIN to 2^32, each split into SL_COUNT second level lists */
+#define FL_MIN 4
+#define FL_COUNT (32 - FL_MIN)
+#define SL_LOG 3
+#define SL_COUNT (1<<SL_LOG)
+#define NO_LISTS (FL_COUNT * SL_COUNT)
+#else
 #define NO_LISTS 11
+#endif
+
+/* Thread cache parameters. CACHE_MAX is the largest payload (in bytes) kept
+ * in a thread cache, one cache list per ALIGNMENT sized payload class */
+#define CACHE_MAX 512
+#define NO_CACHES (CACHE_MAX/ALIGNMENT + 1)
+#define CACHE_BATCH 8
+#define CACHE_LIMIT 32
+
+/* Slab parameters. Objects of up to SLAB_MAX bytes live in SLAB_SIZE runs,
+ * one slab class per ALIGNMENT sized object size */
+#define SLAB_SHIFT 12
+#define SLAB_SIZE (1<<SLAB_SHIFT)
+#define SLAB_MAX 64
+#define NO_SLABS (SLAB_MAX/ALIGNMENT + 1)
+#define SLAB_WORDS (SLAB_SIZE/ALIGNMENT/64)
+
+/* Good fit parameters. A block wasting at most 1/GOOD_SLACK of the request
+ * is good enough, and so is the best of the first GOOD_STEPS blocks that fit */
+#define GOOD_SLACK 8
+#define GOOD_STEPS 8
+
+/* Fast bin parameters. Blocks of up to FAST_MAX bytes are binned by exact
+ * size, and consolidated once the bins hold FAST_LIMIT bytes */
+#define FAST_MAX 1024
+#define NO_FAST (FAST_MAX/ALIGNMENT + 1)
+#define FAST_LIMIT (1<<18)
+
+/* Mapped chunk parameters. A mapped chunk holds its length in the first
+ * word and its header in the second, the payload starts after them */
+#define MMAP_THRESHOLD (1<<18)
+#define MMAP_OVERHEAD DWSIZE
+
+/* Trim parameters. Free blocks smaller than TRIM_MIN can not hold a whole
+ * page and are never released */
+#define TRIM_THRESHOLD (1<<20)
+#define TRIM_MIN (2 * 4096)
+
+/* Heap growth parameters. The heap grows by at least GROW_MIN bytes and at
+ * most 1/GROW_RATIO of its size or HUGE_SIZE, unless a request needs more.
+ * HUGE_SIZE is the transparent huge page size */
+#define GROW_MIN PAGESIZE
+#define GROW_RATIO 8
+#define HUGE_SIZE ((size_t)1<<21)
+
+/* Arena parameters. Chunks are ARENA_CHUNK bytes unless the arena asks for
+ * another size, and requests larger than a quarter chunk get their own */
+#define ARENA_CHUNK (1<<16)
+
+/* Heap profiler parameters. A sample keeps up to PROF_DEPTH return
+ * addresses, from the caller of the allocator on, which lies within the
+ * first PROF_SKIP frames. Stacks and sampled blocks are hashed into
+ * PROF_STACKS and PROF_BUCKETS chains, and their records are carved out of
+ * PROF_CHUNK sized mappings */
+#define PROF_DEPTH 32
+#define PROF_SKIP 4
+#define PROF_STACKS 4096
+#define PROF_BUCKETS (1<<16)
+#define PROF_CHUNK (1<<16)
+
+/* Page map parameters. Each leaf has a byte per slab sized page and covers
+ * 2^(MAP_LEAF_SHIFT + SLAB_SHIFT) bytes of heap (16MB) */
+#define MAP_LEAF_SHIFT 12
+#define MAP_LEAF (1<<MAP_LEAF_SHIFT)
+#define MAP_TOP 4096
 
 /* General Pointer Macros */
 #define MAX(x,y) ((x) > (y) ? (x) : (y))
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
 #define PACK(size, alloc) ((unsigned)((size) | (alloc)))
 #define GET(p) (*(size_t *)(p))
 #define GET_INT(p) (*(unsigned *)(p))
@@ -99,13 +373,21 @@
 /* 32 bits of zeros followed by 32 bits of 1's, a useful bit pattern */
 #define SPLIT ((((size_t)1<<32)) - 1)
 
+/* Offsets count granules of 2^GRANULE_SHIFT bytes, which bounds the span of
+ * the heap. Block sizes must fit in a 4 byte header next to the flags */
+#define GRANULE_SHIFT 3
+#define MAX_SPAN (((size_t)1<<32) << GRANULE_SHIFT)
+#define MAX_BLOCK (SPLIT & ~(size_t)0x7)
+
 /* Mask to see only the first/last 32 bits */
 #define SEE_NEXT(p) ((size_t)p & SPLIT)
 #define SEE_PREV(p) (((size_t)p & ~SPLIT)>>32)
 
 /* Convert the first/last 32 bits of the word into a full 64 bits pointer */
-#define NEXTP(p) (char *) ((SEE_NEXT(p)) ? (INDEX + (SEE_NEXT(p))) : (0))
-#define PREVP(p) (char *) ((SEE_PREV(p)) ? (INDEX + (SEE_PREV(p))) : (0))
+#define NEXTP(p) (char *) ((SEE_NEXT(p)) ? \
+      (INDEX + (SEE_NEXT(p) << GRANULE_SHIFT)) : (0))
+#define PREVP(p) (char *) ((SEE_PREV(p)) ? \
+      (INDEX + (SEE_PREV(p) << GRANULE_SHIFT)) : (0))
 
 /* Set the first/last 32 bits as zero, prevents complicated conditions for 
  * zero checking */
@@ -114,71 +396,424 @@
 
 /* Convert given 64 bit pointer into a 32 bit (offset) form and place it in the
  * first/last 32 bits of the word (dest) */
-#define PUT_NPTR(dest, val)  PUT(dest, GET(dest) | ((size_t)val - INDEX))  
-#define PUT_PPTR(dest, val)  PUT(dest, GET(dest) | (((size_t)val - INDEX)<<32)) 
+#define PUT_NPTR(dest, val)  PUT(dest, GET(dest) | \
+      (((size_t)val - INDEX) >> GRANULE_SHIFT))
+#define PUT_PPTR(dest, val)  PUT(dest, GET(dest) | \
+      ((((size_t)val - INDEX) >> GRANULE_SHIFT)<<32))
 
 /* Clears and then sets the first/last 32 bits to the given pointer */
 #define PUT_PREV(dest, val) CLEAR_PREV(dest); PUT_PPTR(dest, val)
 #define PUT_NEXT(dest, val) CLEAR_NEXT(dest); PUT_NPTR(dest, val) 
 
+/* Second lowest header bit, set for a chunk mapped outside the heap */
+#define MMAPPED 0x2
+
+/* The same bit in the header of a free heap block, set once its whole pages
+ * have been released. Every rewrite of the header clears it, so a block that
+ * has been allocated, split or coalesced since is released again */
+#define RELEASED MMAPPED
+
+/* Second lowest bit of the footer of a free heap block, set by a trim that
+ * found the block free. Freeing writes the footer anew, so the bit survives
+ * only while the block stays free, and the part left over from a split or a
+ * merge into a bigger marked block keeps it. Automatic trims release only
+ * such blocks, not those that will soon be reused */
+#define TRIM_AGED 0x2
+
+/* Length word of a mapped chunk, the start of its mapping and the length
+ * of the mapping. The mapping starts at the page holding the length word */
+#define MMAP_BASE(bp) ((char *)(bp) - MMAP_OVERHEAD)
+#define MMAP_START(bp) \
+   ((char *)((size_t)MMAP_BASE(bp) & ~((size_t)getpagesize() - 1)))
+#define MMAP_LEN(bp) GET(MMAP_BASE(bp))
+
 /* Enhanced header - Instead of assigning one full word for both the
  * header and the footer, they were each converted into 4 byte unsigned
  * integers and fit into a single word. This saved a full word on overhead
- * in both allocated and free bytes.
+ * in both allocated and free bytes. Allocated blocks leave their footer
+ * out, and their payload takes its place.
  *
- * This is what an allocated/free byte looks like
+ * This is what a free block looks like
  *-------------------------------------------
- *   CURRENT BLK HEADER |   PREV BLK FOOTER |  <--- This full (8byte) word is
+ *   PREV BLK FOOTER    | CURRENT BLK HEADER |  <--- This full (8byte) word is
  *-------------------------------------------       referred to as the FULL_HDR
  *   . . . . . . . . . . . . . . . . . . .
  *   . . . . . . . . . . . . . . . . . . .
  *   . . . . . . . . . . . . . . . . . . .
+ * -----------------------------------------
+ *   CURRENT BLK FOOTER |  NEXT BLK HEADER  |
+ *  ---------------------------------------
+ *
+ * and this is an allocated block
+ *-------------------------------------------
+ *   PREV BLK FOOTER    | CURRENT BLK HEADER |
+ *-------------------------------------------
+ *   . . . . . . . . . . . . . . . . . . .
  *   . . . . . . . . . . . . . . . . . . .
  *   . . . . . . . . . . . . . . . . . . .
  * -----------------------------------------
- *   NEXT BLK HEADER |  CURRENT BLK FOOTER  |
+ *   . . . . . . . . .  |  NEXT BLK HEADER  |
  *  ---------------------------------------
  */
 
-/* The full word where the header of the current block and the footer of the
- * previous block are located. Both are 4 bytes each */
+/* The full word where the footer of the previous block and the header of the
+ * current block are located. Both are 4 bytes each */
 #define FULL_HDR(bp)  ((char *)(bp) - WSIZE)
 
-/* Only look the last/first 4 bytes */
-#define PREV(p) ((p)+4) 
-#define THIS(p) (p)
+/* Only look the first/last 4 bytes */
+#define PREV(p) (p)
+#define THIS(p) ((p)+4)
+
+/* Third lowest header bit, set when the previous block is allocated. Only
+ * a block whose previous block is free may use PREV_BLK */
+#define PREV_ALLOC 0x4
 
 /* Useful Implicit list macros */
 #define GET_SIZE(p) (GET_INT(p) & ~(0x7))
 #define GET_ALLOC(p) (GET_INT(p) & 0x1)
+#define GET_MMAPPED(p) (GET_INT(p) & MMAPPED)
+#define GET_RELEASED(p) (GET_INT(p) & RELEASED)
+#define GET_TRIM_AGED(p) (GET_INT(p) & TRIM_AGED)
+#define GET_PREV_ALLOC(p) (GET_INT(p) & PREV_ALLOC)
 #define HDR(bp)  THIS(FULL_HDR(bp))
 #define FTR(bp)  PREV((char *)(bp) + GET_SIZE(HDR(bp)) - WSIZE)
 #define NEXT_BLK(bp) ((char *)(bp) + GET_SIZE(THIS(FULL_HDR(bp))) )
 #define PREV_BLK(bp) ((char *)(bp) - GET_SIZE(PREV(FULL_HDR(bp))) )
 
+/* Rewrite the header of bp keeping its prev alloc bit, and set/clear the
+ * prev alloc bit of bp */
+#define PUT_HDR(bp, val) PUT_INT(HDR(bp), (val) | GET_PREV_ALLOC(HDR(bp)))
+#define SET_PREV_ALLOC(bp) (GET_INT(HDR(bp)) |= PREV_ALLOC)
+#define CLEAR_PREV_ALLOC(bp) (GET_INT(HDR(bp)) &= ~PREV_ALLOC)
+
 /* rounds up to the nearest multiple of ALIGNMENT */
 #define ALIGN(p) (((size_t)(p) + (ALIGNMENT - 1)) & ~0x7)
 
+/* Payload class of a thread cache list, and the payload of a block */
+#define CACHE_CLASS(size) (ALIGN(size) / ALIGNMENT)
+#define PAYLOAD(bp) (GET_SIZE(HDR(bp)) - HSIZE)
+
+/* Slab sized page of a heap pointer, counted from the page holding the
+ * start of the heap, and the slab that page would hold */
+#define PAGE_NO(p) (((size_t)(p) >> SLAB_SHIFT) - (INDEX >> SLAB_SHIFT))
+#define SLAB_OF(p) ((struct slab *)((size_t)(p) & ~(size_t)(SLAB_SIZE - 1)))
+
+/* Link to the next block in a thread cache list, kept in the first word */
+#define CACHE_NEXT(bp) (*(char **)(bp))
+
+/* Index of the most significant set bit of a non zero size */
+#define MSB(x) (63 - __builtin_clzl(x))
+
+/* Treap links of a block in the largest bin, kept in the free list word */
+#define LEFT(bp) PREVP(GET(bp))
+#define RIGHT(bp) NEXTP(GET(bp))
+
+/* Treap order by size then address, and the heap priority of a node */
+#define TREE_LESS(a, b) (GET_SIZE(HDR(a)) < GET_SIZE(HDR(b)) || \
+   (GET_SIZE(HDR(a)) == GET_SIZE(HDR(b)) && (char *)(a) < (char *)(b)))
+#define PRIO(bp) ((unsigned)(((size_t)(bp) >> 3) * 2654435761u))
+
+/* Record that a free list became non empty/empty. Only TLSF keeps bitmaps */
+#ifdef TLSF
+#define BIN_SET(bin) (fl_bitmap |= 1U << ((bin) / SL_COUNT), \
+   sl_bitmap[(bin) / SL_COUNT] |= 1U << ((bin) % SL_COUNT))
+#define BIN_CLEAR(bin) do { \
+   if ((sl_bitmap[(bin) / SL_COUNT] &= ~(1U << ((bin) % SL_COUNT))) == 0) \
+      fl_bitmap &= ~(1U << ((bin) / SL_COUNT)); } while (0)
+#else
+#define BIN_SET(bin)
+#define BIN_CLEAR(bin)
+#endif
+
+/* Record that the heap up to end has been handed out */
+#ifdef HEAP_ZEROED
+#define MARK_USED(end) (fresh_mark = MAX(fresh_mark, (char *)(end)))
+#else
+#define MARK_USED(end)
+#endif
+
 /* Define global variables */
 static char *heap;
 //static char *free_list;
-int errno;
+static size_t mmap_threshold = MMAP_THRESHOLD;
+
+/* Bytes in the free lists, and bytes freed since the last trim */
+static size_t free_bytes;
+static size_t freed_since_trim;
+static size_t trim_threshold = TRIM_THRESHOLD;
+
+/* Bytes the heap grows by next, and the end of the heap marked for huge
+ * pages */
+static size_t grow_step;
+static char *huge_mark;
+
+/* Soft limit on heap and mapped bytes, 0 for none, and the callbacks run
+ * before it is crossed. in_pressure is set while they run */
+struct pressure_cb {
+   mm_pressure_fn fn;
+   void *arg;
+};
+static size_t mem_limit;
+static struct pressure_cb pressure_cbs[MM_PRESSURE_MAX];
+static int npressure;
+static int in_pressure;
+
+/* Fast bins, LIFO lists of free blocks linked like thread cache lists, and
+ * the bytes they hold */
+static char *fast_bins[NO_FAST];
+static size_t fast_bytes;
+
+/* Placement and list order of the heap, and those mm_set_policy picked for
+ * the next mm_init. Next fit resumes each list at its rover */
+static int fit_policy = MM_FIT_FIRST;
+static int order_policy = MM_ORDER_LIFO;
+static int next_fit_policy = MM_FIT_FIRST;
+static int next_order_policy = MM_ORDER_LIFO;
+static char *rover[NO_LISTS];
+
+/* Heap memory from here up has never been handed out, see calloc */
+static char *fresh_mark;
+
+/* Counters reported by mm_stats, guarded by the heap lock except for the
+ * mapped chunk and inbox counters which are updated atomically */
+#if NO_LISTS > MM_STATS_BINS
+#error "mm_stats can not report every free list bin"
+#endif
+static struct mm_stats stats;
+
+/* The shared heap and its free lists are only touched under heap_lock.
+ * heap_epoch changes on every mm_init so that thread caches filled from an
+ * older heap are dropped instead of being handed out again. */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long heap_epoch;
+
+/* Blocks freed while the heap lock was taken, still marked as allocated and
+ * linked through their first payload word. Pushed with compare and swap,
+ * emptied with an exchange by the holder of the heap lock. */
+static char *remote_inbox;
+
+#define HEAP_LOCK() do { pthread_mutex_lock(&heap_lock);\
+   remote_drain(); } while (0)
+
+/* Heap checking mode, see mm_set_check. Only used with HEAP_CHECK */
+static int check_mode = MM_CHECK_DIRTY;
+static unsigned check_one_in = 1;
+
+#ifdef HEAP_CHECK
+/* Blocks touched since the last check. ndirty goes past DIRTY_MAX once the
+ * set overflows, and the next check is a full one */
+#define DIRTY_MAX 256
+static char *dirty[DIRTY_MAX];
+static unsigned ndirty;
+static unsigned long check_seed = 88172645463325252UL;
+
+#define MARK_DIRTY(bp) (ndirty < DIRTY_MAX ? \
+      (void)(dirty[ndirty++] = (char *)(bp)) : (void)(ndirty = DIRTY_MAX + 1))
+#define DIRTY_DROP(bp) dirty_drop((char *)(bp))
+#define HEAP_UNLOCK() do { heap_check_point(__LINE__);\
+   pthread_mutex_unlock(&heap_lock); } while (0)
+#else
+#define MARK_DIRTY(bp)
+#define DIRTY_DROP(bp)
+#define HEAP_UNLOCK() pthread_mutex_unlock(&heap_lock)
+#endif
+
+#ifdef MM_PRELOAD
+/* Start and end of the heap in the data segment, and the once control of
+ * the first allocation that initializes it */
+static char *mem_start, *mem_brk;
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+#define HEAP_READY() (heap != NULL || preload_init())
+#else
+#define HEAP_READY() 1
+#endif
+
+#ifdef TLSF
+/* A set bit marks a non empty first level range / second level list */
+static unsigned fl_bitmap;
+static unsigned sl_bitmap[FL_COUNT];
+#endif
+
+/* Heap profiler state, see mm_set_sample_rate. A stack record tallies the
+ * samples taken at one call stack, a sample record is a sampled block that
+ * has not been freed yet. Both are guarded by prof_lock, except that free
+ * peeks at its hash chain before taking the lock */
+struct prof_stack {
+   struct prof_stack *next;
+   unsigned long live_count, total_count;
+   size_t live_bytes, total_bytes;
+   int depth;
+   void *pc[PROF_DEPTH];
+};
+struct prof_sample {
+   struct prof_sample *next;
+   void *bp;
+   struct prof_stack *stack;
+   unsigned long count;
+   size_t bytes;
+};
+static size_t sample_rate;
+static unsigned long prof_live;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct prof_stack *prof_stacks[PROF_STACKS];
+static struct prof_sample *prof_samples[PROF_BUCKETS];
+static struct prof_sample *prof_spare;
+static char *prof_pool, *prof_pool_end;
+
+/* Buffered output of mm_profile_dump and mm_dump_layout */
+struct dump_out {
+   int fd;
+   int err;
+   size_t len;
+   char buf[4096];
+};
+
+/* Bytes the calling thread allocates before its next sample, its random
+ * state, and a flag set while it is inside the profiler or inside a call
+ * that accounts for the malloc and free it makes itself */
+static __thread long sample_left;
+static __thread unsigned long prof_seed;
+static __thread int prof_busy;
+
+#define PROF_ALLOC(bp, size) (sample_rate != 0 ?\
+      prof_alloc((bp), (size), __builtin_return_address(0)) : (void *)(bp))
+#define PROF_FREE(bp) do { if (prof_live != 0) prof_free(bp); } while (0)
+
+/* Per thread cache of free blocks, one LIFO list per payload class */
+struct thread_cache {
+   unsigned long epoch;
+   char *list[NO_CACHES];
+   unsigned count[NO_CACHES];
+   unsigned long allocs;
+   unsigned long frees;
+};
+static __thread struct thread_cache tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+/* Slab header, at the start of its SLAB_SIZE aligned run. A set bit in map
+ * marks a free object. Slabs with free objects are linked per class. */
+struct slab {
+   struct slab *next;
+   struct slab *prev;
+   unsigned size;
+   unsigned nobjs;
+   unsigned nfree;
+   unsigned first;
+   unsigned long map[SLAB_WORDS];
+};
+static struct slab *slabs[NO_SLABS];
+
+/* Arena chunk, linked into its arena's list of chunks */
+struct arena_chunk {
+   struct arena_chunk *next;
+   char data[];
+};
+
+/* An arena bump allocates from cur to end in its current chunk */
+struct mm_arena {
+   struct arena_chunk *chunks;
+   struct arena_chunk *current;
+   char *cur;
+   char *end;
+   size_t chunk_size;
+};
+
+/* Page map, a non zero byte marks a heap page that holds a slab. Leaves
+ * are allocated from the heap the first time a slab lands in their range. */
+static unsigned char *page_map[MAP_TOP];
 
 /* Function prototypes */
 void *coalesce(void *bp);
 void *grow_heap(size_t words);
+static void *extend_heap(size_t need);
+static void advise_huge(char *end);
+static size_t footprint(void);
+static void *relieve_pressure(size_t asize, size_t want);
+static void map_pressure(size_t len);
+static void *realloc_block(void *oldptr, size_t size);
+static void *prof_alloc(void *bp, size_t size, void *caller);
+static void *prof_sample(void *bp, size_t size, void *caller);
+static void prof_free(void *bp);
+static size_t prof_batch(void **out, size_t got, size_t size, void *caller);
+static void *prof_carve(size_t size);
+static void prof_reset(void);
+static void dump_put(struct dump_out *o, const char *fmt, ...)\
+   __attribute__((format(printf, 2, 3)));
+static void dump_flush(struct dump_out *o);
+static void dump_write(struct dump_out *o, const void *p, size_t n);
+static void layout_rec(struct dump_out *o, char *bp, unsigned kind);
+static void prof_frame(struct dump_out *o, void *pc);
 void *find_fit(size_t asize);
+static void *find_fit_all(size_t asize);
+static char *list_fit(int bin, size_t asize);
+static void consolidate(void);
+void *heap_malloc(size_t size);
+void heap_free(void *bp);
+void *heap_memalign(size_t align, size_t size);
+size_t usable_size(void *bp);
 void place(void *bp, size_t asize);
+void *resize_in_place(void *bp, size_t asize);
+void split_tail(void *bp, size_t asize);
+static void clear_stale(char *bp);
+void *mmap_alloc(size_t size);
+static void *mmap_memalign(size_t align, size_t size);
+void mmap_free(void *bp);
+void *mmap_realloc(void *bp, size_t size);
+size_t heap_trim(int all);
+static size_t trim_top(int all);
+static size_t release_pages(char *bp, int all);
+static size_t resident_bytes(size_t start, size_t end);
+#ifndef TLSF
+static size_t release_tree(char *bp, int all);
+#endif
 void lifo_insert(void *bp);
 void remove_from_list(void *bp);
 static int in_heap(const void *p);
 static int aligned(const void *p);
 void point_check(const void *bp, char* type, int lineno);
-int find_size_bin(int asize);
+int find_size_bin(size_t asize);
 void check_pro_epi(int lineno);
 void check_head_foot(void *bp, int lineno);
 void check_match_bin(void *bp, int lineno, int count, int x);
 void check_coalesce(void *bp, int lineno);
+#ifndef TLSF
+static void set_left(char *bp, char *child);
+static void set_right(char *bp, char *child);
+static char *tree_insert(char *root, char *bp);
+static char *tree_remove(char *root, char *bp);
+static char *tree_merge(char *left, char *right);
+int check_tree(char *bp, char *lo, char *hi, int lineno);
+#endif
+static struct thread_cache *tcache_get(void);
+static void tcache_refill(struct thread_cache *tc, int cls);
+static void tcache_flush(struct thread_cache *tc, int cls, unsigned keep);
+static void tcache_init_key(void);
+static void tcache_exit(void *arg);
+static void tcache_fold(struct thread_cache *tc);
+static void remote_push(char *first, char *last, unsigned long n);
+static void remote_drain(void);
+static size_t heap_carve(size_t size, size_t n, void **out);
+static int cmp_ptr(const void *a, const void *b);
+static struct slab *slab_lookup(const void *bp);
+static void *slab_alloc(size_t size);
+static void slab_free(struct slab *s, void *bp);
+static struct slab *slab_new(int cls);
+static int page_map_set(void *p, unsigned char val);
+void check_slab(struct slab *s, int cls, int lineno);
+#ifdef HEAP_CHECK
+static void dirty_drop(char *bp);
+static void heap_check_point(int lineno);
+void check_block(void *bp, int lineno);
+#endif
+#ifdef MM_PRELOAD
+static int preload_init(void);
+static void heap_init_once(void);
+static void fork_prepare(void);
+static void fork_parent(void);
+static void fork_child(void);
+static void profile_exit(void) __attribute__((destructor));
+#endif
 
 /*
  * mm_init - Initialize heap: Return -1 on error, 0 on success.
@@ -189,82 +824,462 @@ void check_coalesce(void *bp, int lineno);
  */
 int mm_init(void) {
    char *bp;
-   if ((heap = mem_sbrk((3 + NO_LISTS) * WSIZE)) == NULL){
+   pthread_mutex_lock(&heap_lock);
+   heap_epoch++;
+   if ((bp = mem_sbrk((3 + NO_LISTS) * WSIZE)) == (void *)-1){
+      pthread_mutex_unlock(&heap_lock);
       return -1;
    }
+   heap = bp;
    PUT(heap, PACK(0,0)); 			        // Align to even
    PUT_INT(THIS(heap + (NO_LISTS + 1)*WSIZE), PACK(WSIZE, 1)); // Header
    PUT_INT(PREV(heap + (NO_LISTS + 2)*WSIZE), PACK(WSIZE, 1)); // Footer
    
    /* Epilogue header is packed into same block as prologue footer */
-   PUT_INT(THIS(heap + (NO_LISTS + 2)*WSIZE), PACK(0, 1));     
+   PUT_INT(THIS(heap + (NO_LISTS + 2)*WSIZE), PACK(0, PREV_ALLOC | 1));
    
    /* Initialize free lists for each sub group within the heap */
    heap += (2+NO_LISTS)*WSIZE;
    for (int x = 0; x < NO_LISTS; x++){
       PUT((char *)FULL_HEAP + (x * WSIZE), (size_t)0);
    }
+   memset(slabs, 0, sizeof(slabs));
+   memset(page_map, 0, sizeof(page_map));
+   memset(fast_bins, 0, sizeof(fast_bins));
+   memset(rover, 0, sizeof(rover));
+   fit_policy = next_fit_policy;
+   order_policy = next_order_policy;
+   fast_bytes = 0;
+   free_bytes = 0;
+   freed_since_trim = 0;
+   fresh_mark = heap;
+   grow_step = GROW_MIN;
+   huge_mark = NULL;
+   __atomic_store_n(&remote_inbox, NULL, __ATOMIC_RELAXED);
+   prof_reset();
+#ifdef HEAP_CHECK
+   ndirty = 0;
+#endif
+   memset(&stats, 0, sizeof(stats));
+   stats.nbins = NO_LISTS;
+#ifdef TLSF
+   fl_bitmap = 0;
+   memset(sl_bitmap, 0, sizeof(sl_bitmap));
+#endif
    
-   if((bp = grow_heap(PAGESIZE/WSIZE)) == NULL){
-      return -1;
-   }
-   return 0;
+   bp = grow_heap(PAGESIZE/WSIZE);
+   pthread_mutex_unlock(&heap_lock);
+   return (bp == NULL) ? -1 : 0;
 }
 
 
 /*
  * grow_heap - Grows heap. Allocates new page as free and
- * reassigned an allocated epilogue to mark end of heap.
+ * reassigned an allocated epilogue to mark end of heap. Fails with ENOMEM
+ * if the new block or the heap would exceed MAX_BLOCK or MAX_SPAN.
  */
 void *grow_heap(size_t words){
    char *bp;
-   unsigned size;
+   size_t size;
    
    /* New page bytes should be a multiple of 8 */
    size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
+   if (size > MAX_BLOCK ||\
+	 (size_t)mem_heap_hi() + 1 + size - INDEX > MAX_SPAN){
+      dbg_printf("grow_heap: %zu more bytes exceed the heap limits\n", size);
+      errno = ENOMEM;
+      return NULL;
+   }
    if ((long int)(bp = mem_sbrk(size)) < 0){
       return NULL;
    }
+   stats.grows++;
+   stats.grow_bytes += size;
+   advise_huge(bp + size);
 
-   /* Set the new page as free */
-   PUT_INT(HDR(bp), PACK(size, 0));
+   /* Set the new page as free, the old epilogue knows about the block before */
+   PUT_HDR(bp, PACK(size, 0));
    PUT_INT(FTR(bp), PACK(size, 0));
    PUT_INT(HDR(NEXT_BLK(bp)), PACK(0, 1));
    return coalesce(bp);
 }
+
+/*
+ * extend_heap - Grows the heap for a request of asize bytes, by grow_step or
+ * 1/GROW_RATIO of the heap if that is more than the request needs, and up to
+ * a HUGE_SIZE boundary once grow_step has reached HUGE_SIZE. The grow stays
+ * within the soft limit if the request allows, and if it does not the
+ * pressure callbacks get to free memory first. Falls back to growing by what
+ * is missing if the larger step fails. Returns a free block of at least
+ * asize bytes, normally the one at the top of the heap, or NULL if out of
+ * memory.
+ */
+static void *extend_heap(size_t asize){
+   char *top = (char *)mem_heap_hi() + 1;
+   size_t need = asize, size, end, used;
+   char *bp;
+
+   /* A free block at the top is merged with the new memory */
+   if (!GET_PREV_ALLOC(HDR(top))){
+      need -= MIN(need, GET_SIZE(HDR(PREV_BLK(top))));
+   }
+   need = MAX(need, GROW_MIN);
+
+   /* Let the pressure callbacks free memory before crossing the limit */
+   used = footprint();
+   if (mem_limit && used + need > mem_limit &&\
+	 (bp = relieve_pressure(asize, used + need - mem_limit)) != NULL){
+      return bp;
+   }
+
+   size = MAX(need, MIN(grow_step, MAX(mem_heapsize() / GROW_RATIO, GROW_MIN)));
+   if (size >= HUGE_SIZE){
+      end = ((size_t)top + size + HUGE_SIZE - 1) & ~(HUGE_SIZE - 1);
+      size = end - (size_t)top;
+   }
+   if (mem_limit && used + size > mem_limit){
+      size = MAX(need,\
+	 (mem_limit - MIN(used, mem_limit)) & ~(size_t)(WSIZE - 1));
+   }
+
+   if ((bp = grow_heap(size/WSIZE)) == NULL && size > need){
+      bp = grow_heap(need/WSIZE);
+   }
+   if (bp != NULL){
+      grow_step = MIN(2 * grow_step, HUGE_SIZE);
+      if (mem_limit && footprint() > mem_limit){
+	 stats.limit_overruns++;
+      }
+   }
+   return bp;
+}
+
+/*
+ * advise_huge - Marks the whole huge pages of the heap below end that are
+ * not marked yet with MADV_HUGEPAGE, and counts them in stats.huge_bytes.
+ */
+static void advise_huge(char *end){
+#ifdef MADV_HUGEPAGE
+   size_t start = ((size_t)mem_heap_lo() + HUGE_SIZE - 1) & ~(HUGE_SIZE - 1);
+
+   start = MAX(start, (size_t)huge_mark);
+   end = (char *)((size_t)end & ~(HUGE_SIZE - 1));
+   if ((size_t)end <= start ||\
+	 madvise((void *)start, (size_t)end - start, MADV_HUGEPAGE) < 0){
+      return;
+   }
+   stats.huge_bytes += (size_t)end - start;
+   huge_mark = end;
+#else
+   (void)end;
+#endif
+}
+
+/*
+ * footprint - Bytes taken from the system for the heap and mapped chunks.
+ */
+static size_t footprint(void){
+   return mem_heapsize() +\
+	 __atomic_load_n(&stats.mapped_bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * relieve_pressure - Calls the pressure callbacks until they report want
+ * bytes released. What they freed is in the inbox or the calling thread's
+ * cache, both are freed into the heap with trimming held off. Returns a free
+ * block of at least asize bytes if that made room for one, else NULL. Does
+ * nothing while the callbacks run. Caller must hold the heap lock.
+ */
+static void *relieve_pressure(size_t asize, size_t want){
+   struct thread_cache *tc = tcache_get();
+   size_t released = 0;
+   char *bp;
+
+   if (in_pressure || npressure == 0){
+      return NULL;
+   }
+   in_pressure = 1;
+   stats.pressure_events++;
+   for (int x = 0; x < npressure && released < want; x++){
+      released += pressure_cbs[x].fn(want - released, pressure_cbs[x].arg);
+   }
+   for (int cls = 0; cls < NO_CACHES; cls++){
+      while (tc->count[cls] > 0){
+	 bp = tc->list[cls];
+	 tc->list[cls] = CACHE_NEXT(bp);
+	 tc->count[cls]--;
+	 heap_free(bp);
+      }
+   }
+   remote_drain();
+   in_pressure = 0;
+   return (asize > 0) ? find_fit_all(asize) : NULL;
+}
+
+/*
+ * map_pressure - Runs the pressure callbacks if mapping len more bytes would
+ * cross the soft limit. Takes the heap lock.
+ */
+static void map_pressure(size_t len){
+   size_t used;
+
+   if (mem_limit == 0 || (used = footprint()) + len <= mem_limit){
+      return;
+   }
+   HEAP_LOCK();
+   relieve_pressure(0, used + len - mem_limit);
+   HEAP_UNLOCK();
+}
+
+/*
+ * mm_set_limit - Sets the soft limit on heap and mapped bytes, 0 for none.
+ */
+void mm_set_limit(size_t bytes){
+   pthread_mutex_lock(&heap_lock);
+   mem_limit = bytes;
+   pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * mm_add_pressure_callback - Registers fn to be called with arg before the
+ * soft limit is crossed. Returns -1 if there is no room for it.
+ */
+int mm_add_pressure_callback(mm_pressure_fn fn, void *arg){
+   int ret = -1;
+
+   pthread_mutex_lock(&heap_lock);
+   if (npressure < MM_PRESSURE_MAX){
+      pressure_cbs[npressure].fn = fn;
+      pressure_cbs[npressure++].arg = arg;
+      ret = 0;
+   }
+   pthread_mutex_unlock(&heap_lock);
+   return ret;
+}
+
+/*
+ * mm_remove_pressure_callback - Unregisters the callback added with fn and
+ * arg. Returns -1 if there is none.
+ */
+int mm_remove_pressure_callback(mm_pressure_fn fn, void *arg){
+   int ret = -1;
+
+   pthread_mutex_lock(&heap_lock);
+   for (int x = 0; x < npressure; x++){
+      if (pressure_cbs[x].fn == fn && pressure_cbs[x].arg == arg){
+	 memmove(&pressure_cbs[x], &pressure_cbs[x + 1],\
+	       (npressure - x - 1) * sizeof(pressure_cbs[0]));
+	 npressure--;
+	 ret = 0;
+	 break;
+      }
+   }
+   pthread_mutex_unlock(&heap_lock);
+   return ret;
+}
+
 /*
- * malloc - Allocates size bytes on heap. Searches for a fit using segregated
- * free lists. Calls for a new page if there is no fit. Return NULL if not
- * enough memory is available.
+ * malloc - Allocates size bytes on heap. Requests of up to CACHE_MAX bytes
+ * are served from the calling thread's cache, which is refilled in batches
+ * from the shared heap. Requests of mmap_threshold bytes or more are mapped
+ * on their own, the rest go straight to heap_malloc under the heap lock.
+ * Return NULL if not enough memory is available.
  */
 void *malloc (size_t size) {
-   unsigned asize;
-   unsigned extendsize;
+   struct thread_cache *tc;
+   char *bp;
+   int cls;
+
+   if (size <= 0 || !HEAP_READY())
+      return NULL;
+
+   if (size <= CACHE_MAX){
+      tc = tcache_get();
+      cls = CACHE_CLASS(size);
+      if (tc->list[cls] == NULL){
+         tcache_refill(tc, cls);
+         if (tc->list[cls] == NULL){
+            return NULL;
+         }
+      }
+      bp = tc->list[cls];
+      tc->list[cls] = CACHE_NEXT(bp);
+      tc->count[cls]--;
+      tc->allocs++;
+      return PROF_ALLOC(bp, size);
+   }
+
+   if (size >= mmap_threshold){
+      return PROF_ALLOC(mmap_alloc(size), size);
+   }
+
+   HEAP_LOCK();
+   bp = heap_malloc(size);
+   HEAP_UNLOCK();
+   return PROF_ALLOC(bp, size);
+}
+
+/*
+ * heap_malloc - Allocates size bytes from the shared heap. Requests of up to
+ * SLAB_MAX bytes are taken from a slab, the rest search for a fit using
+ * segregated free lists. Calls for a new page if there is no fit.
+ * Caller must hold the heap lock.
+ */
+void *heap_malloc(size_t size) {
+   size_t asize;
    char *bp;
 
-   if (size <= 0)
+   if (size <= SLAB_MAX)
+      return slab_alloc(size);
+   if (size > MAX_BLOCK - DWSIZE){
+      errno = ENOMEM;
       return NULL;
+   }
 
    /* Adjust block size to a minimum of two words and align */
-   if (size <= WSIZE)
-      asize = WSIZE + WSIZE;
+   if (size <= MIN_SIZE - HSIZE)
+      asize = MIN_SIZE;
    else
-      asize = ALIGN(size + WSIZE);
+      asize = ALIGN(size + HSIZE);
+
+   /* Reuse a block of the same size */
+   if (asize <= FAST_MAX && (bp = fast_bins[asize / ALIGNMENT]) != NULL){
+      fast_bins[asize / ALIGNMENT] = CACHE_NEXT(bp);
+      fast_bytes -= asize;
+      stats.fast_hits++;
+      stats.allocs[find_size_bin(asize)]++;
+      return bp;
+   }
 
    /* Search for fit*/
-   if ((bp = find_fit(asize)) != NULL){
+   if ((bp = find_fit_all(asize)) != NULL){
       place(bp,asize);
       return bp;
    }
    /* No fit, get more memory */
-   extendsize = MAX(asize, PAGESIZE);
-   if ((bp = grow_heap(extendsize/WSIZE)) == NULL){
+   if ((bp = extend_heap(asize)) == NULL){
       return NULL;
    }
    place(bp, asize);
    return bp;
 }
 
+/*
+ * heap_memalign - Allocates size bytes from the shared heap at an address
+ * that is a multiple of align, a power of two. The fit is searched with
+ * enough slack for the aligned address to leave at least a minimum sized
+ * block in front of it, which is split off and returned to the free lists.
+ * Caller must hold the heap lock.
+ */
+void *heap_memalign(size_t align, size_t size) {
+   size_t asize, total, bsize, lead;
+   char *bp, *ap;
+
+   if (align <= ALIGNMENT)
+      return heap_malloc(size);
+   if (align > MAX_BLOCK / 2 || size > MAX_BLOCK - DWSIZE - align - MIN_SIZE){
+      errno = ENOMEM;
+      return NULL;
+   }
+
+   if (size <= MIN_SIZE - HSIZE)
+      asize = MIN_SIZE;
+   else
+      asize = ALIGN(size + HSIZE);
+
+   total = asize + align + MIN_SIZE;
+   if ((bp = find_fit_all(total)) == NULL){
+      if ((bp = extend_heap(total)) == NULL){
+         return NULL;
+      }
+   }
+
+   /* First aligned address that leaves room for a free block in front */
+   ap = (char *)(((size_t)bp + align - 1) & ~(align - 1));
+   if (ap != bp && (size_t)(ap - bp) < MIN_SIZE)
+      ap += align;
+
+   /* Split the leading slack off as its own free block */
+   if (ap != bp){
+      bsize = GET_SIZE(HDR(bp));
+      lead = ap - bp;
+      remove_from_list(bp);
+      stats.splits++;
+      PUT_HDR(bp, PACK(lead, 0));
+      PUT_INT(FTR(bp), PACK(lead, 0));
+      lifo_insert(bp);
+      PUT_INT(HDR(ap), PACK(bsize - lead, 0));
+      PUT_INT(FTR(ap), PACK(bsize - lead, 0));
+      lifo_insert(ap);
+   }
+   place(ap, asize);
+   return ap;
+}
+
+/*
+ * usable_size - Returns the number of bytes the caller may use at allocated
+ * pointer bp, the object size for slab objects and the payload otherwise.
+ */
+size_t usable_size(void *bp) {
+   struct slab *s;
+   if ((s = slab_lookup(bp)) != NULL)
+      return s->size;
+   if (GET_MMAPPED(HDR(bp)))
+      return MMAP_START(bp) + MMAP_LEN(bp) - (char *)bp;
+   return PAYLOAD(bp);
+}
+
+#ifdef TLSF
+/*
+ * find_size_bin - Calculates the TLSF list for a block of size 'asize'. The
+ * first level is the position of the most significant bit, the second level
+ * is given by the SL_LOG bits that follow it. Sizes past the last first
+ * level range all go to the final list.
+ */
+int find_size_bin(size_t asize){
+   int fl = MSB(asize);
+   int sl = (asize >> (fl - SL_LOG)) & (SL_COUNT - 1);
+   if (fl - FL_MIN >= FL_COUNT)
+      return NO_LISTS - 1;
+   return (fl - FL_MIN) * SL_COUNT + sl;
+}
+
+/*
+ * find fit - Rounds asize up to the start of the next second level list so
+ * that any block in the chosen list or above fits, then finds the first non
+ * empty such list from the bitmaps. The head of that list is returned.
+ * Only the final list, whose sizes are not bounded, is searched with the
+ * placement policy.
+ */
+void *find_fit(size_t asize){
+   unsigned map;
+   int bin, fl, sl;
+
+   stats.fit_searches++;
+   bin = find_size_bin(asize + ((size_t)1 << (MSB(asize) - SL_LOG)) - 1);
+   fl = bin / SL_COUNT;
+   sl = bin % SL_COUNT;
+
+   /* Non empty lists in the same first level range, else in a larger one */
+   if ((map = sl_bitmap[fl] & (~0U << sl)) == 0){
+      if (fl + 1 >= FL_COUNT || (map = fl_bitmap & (~0U << (fl + 1))) == 0)
+         map = 0;
+      else{
+         fl = __builtin_ctz(map);
+         map = sl_bitmap[fl];
+      }
+   }
+
+   if (map != 0){
+      bin = fl * SL_COUNT + __builtin_ctz(map);
+      if (bin != NO_LISTS - 1){
+         stats.fit_steps++;
+         return (char *)GET(FULL_HEAP + bin*WSIZE);
+      }
+   }
+   return list_fit(NO_LISTS - 1, asize);
+}
+#else
 /*
  * find_size_bin - Calculates approporiate size bin for given block of size
  * 'asize'. The range of blocks in each range are successive powers of 2
@@ -272,9 +1287,9 @@ void *malloc (size_t size) {
  * next list has a range 2^8 to 2^9 ... the final list has a range of 2^17 to
  * infinity (or 2^32).
  */
-int find_size_bin(int asize){
+int find_size_bin(size_t asize){
    int size_bin = 0;
-   int cut_off = 64;
+   size_t cut_off = 64;
    while (asize > (cut_off-1)){
       asize = asize>>1;
       size_bin += 1;
@@ -288,8 +1303,10 @@ int find_size_bin(int asize){
 
 /*
  * find fit - Scans free lists for suitable size bin starts with minimum
- * with minimum size and proceeds till largest size. First fit scheme is used 
- * for all size bins except the largest bin where a best fit scheme is used.
+ * with minimum size and proceeds till largest size. The placement policy is
+ * used for all size bins except the largest bin where a best fit scheme is
+ * used. The best fit is the smallest treap node that is not smaller than
+ * asize.
  */
 
 void *find_fit(size_t asize){
@@ -298,9 +1315,8 @@ void *find_fit(size_t asize){
    int size_bin;
    size_bin = find_size_bin(asize);
    char *best_fitp;
-   size_t best_fit;   
    best_fitp = NULL;
-   best_fit = (1<<31);
+   stats.fit_searches++;
 
    for (int x = size_bin; x < NO_LISTS; x++){
       free_list = (FULL_HEAP + (x*WSIZE));
@@ -313,27 +1329,89 @@ void *find_fit(size_t asize){
       /* Best fit for largest list */
       if (x == NO_LISTS-1){
       do{
+	    stats.fit_steps++;
 	    if (asize <= (size_t)GET_SIZE(HDR(bp))) {
-	       if ((size_t)GET_SIZE(HDR(bp)) <= best_fit){
-		  best_fitp = bp;
-		  best_fit = (size_t)GET_SIZE(HDR(bp));
-               }
+	       best_fitp = bp;
+	       bp = (char *)LEFT(bp);
+	    }
+	    else {
+	       bp = (char *)RIGHT(bp);
 	    }
-	    bp = (char *)NEXTP(GET(bp));
 	 } while ( bp != 0);
       }
 
-      /* First fit for all other size lists */
-      else {do{ 
-	 if (asize <= GET_SIZE(HDR(bp))) {
+      /* Placement policy for all other size lists */
+      else if ((bp = list_fit(x, asize)) != NULL){
+	 return bp;
+      }
+   }
+
+   return best_fitp;
+}
+#endif /* def TLSF */
+
+/*
+ * list_fit - Searches free list bin for a block of at least asize bytes
+ * with the placement policy. Returns NULL if none fits.
+ */
+static char *list_fit(int bin, size_t asize){
+   char *head = (char *)GET(FULL_HEAP + bin*WSIZE);
+   char *bp, *best = NULL;
+   size_t size, best_size = (size_t)-1;
+   int fits = 0;
+
+   if (head == NULL){
+      return NULL;
+   }
+
+   /* Next fit goes round the list once, starting at the rover */
+   if (fit_policy == MM_FIT_NEXT){
+      char *start = (rover[bin] != NULL) ? rover[bin] : head;
+      bp = start;
+      do {
+	 stats.fit_steps++;
+	 if (asize <= GET_SIZE(HDR(bp))){
+	    rover[bin] = bp;
 	    return bp;
 	 }
-	 bp = (char *)NEXTP(GET(bp));
-      } while ( bp != 0); 
+	 if ((bp = NEXTP(GET(bp))) == NULL){
+	    bp = head;
+	 }
+      } while (bp != start);
+      return NULL;
    }
+
+   for (bp = head; bp != NULL; bp = NEXTP(GET(bp))){
+      stats.fit_steps++;
+      if ((size = GET_SIZE(HDR(bp))) < asize){
+	 continue;
+      }
+      if (fit_policy == MM_FIT_FIRST || size == asize){
+	 return bp;
+      }
+      if (size < best_size){
+	 best = bp;
+	 best_size = size;
+      }
+      if (fit_policy == MM_FIT_GOOD && (size - asize <= asize / GOOD_SLACK ||\
+	       ++fits >= GOOD_STEPS)){
+	 return best;
+      }
    }
+   return best;
+}
 
-   return best_fitp;
+/*
+ * find_fit_all - Searches the free lists like find_fit, and searches them
+ * again after consolidating the fast bins if that fails.
+ */
+static void *find_fit_all(size_t asize){
+   char *bp;
+   if ((bp = find_fit(asize)) == NULL && fast_bytes > 0){
+      consolidate();
+      bp = find_fit(asize);
+   }
+   return bp;
 }
 
 /*
@@ -344,32 +1422,66 @@ void *find_fit(size_t asize){
 void place(void *bp, size_t asize){
    size_t init_size;
    init_size = GET_SIZE(HDR(bp));
+   stats.allocs[find_size_bin(asize)]++;
    if ((init_size - asize) >= (MIN_SIZE)){
+      stats.splits++;
       remove_from_list(bp);
-      PUT_INT(HDR(bp), PACK(asize, 1));
-      PUT_INT(FTR(bp), PACK(asize, 1));
+      MARK_USED((char *)bp + asize);
+      MARK_DIRTY(bp);
+      PUT_HDR(bp, PACK(asize, 1));
 
       bp = NEXT_BLK(bp);
-      PUT_INT(HDR(bp), PACK(init_size - asize, 0)); 
-      PUT_INT(FTR(bp), PACK(init_size - asize, 0));
+      PUT_INT(HDR(bp), PACK(init_size - asize, PREV_ALLOC)); 
+      PUT_INT(FTR(bp), PACK(init_size - asize, GET_TRIM_AGED(FTR(bp))));
       lifo_insert(bp);
    }
    else { 
       remove_from_list(bp);
-      PUT_INT(HDR(bp), PACK(init_size, 1));
-      PUT_INT(FTR(bp), PACK(init_size, 1)); 
+      MARK_USED((char *)bp + init_size);
+      MARK_DIRTY(bp);
+      PUT_HDR(bp, PACK(init_size, 1));
+      SET_PREV_ALLOC(NEXT_BLK(bp));
    }
 }
 
 /*
  * lifo_insert - Inserts block bp into approporiate free list at 
- * the start of list
+ * the start of list, or in address order if the heap keeps its lists
+ * that way
  */
 void lifo_insert(void *bp){
-   char *free_list;
+   char *free_list, *prev, *next;
    int size_bin;
    size_bin = find_size_bin(GET_SIZE(HDR(bp)));
    free_list = (char *)(FULL_HEAP + (size_bin*WSIZE));
+   free_bytes += GET_SIZE(HDR(bp));
+   MARK_DIRTY(bp);
+
+#ifndef TLSF
+   /* Largest bin is a treap */
+   if (size_bin == NO_LISTS-1){
+      PUT(bp, (size_t)0);
+      PUT(free_list, (size_t)tree_insert((char *)GET(free_list), bp));
+      return;
+   }
+#endif
+
+   /* Address order, after the last block below bp unless bp goes first */
+   if (order_policy == MM_ORDER_ADDRESS && GET(free_list) != (size_t)0 &&\
+	 (char *)GET(free_list) < (char *)bp){
+      prev = (char *)GET(free_list);
+      while ((next = NEXTP(GET(prev))) != NULL && next < (char *)bp){
+	 prev = next;
+      }
+      PUT(bp, (size_t)0);
+      if (next != NULL){
+	 PUT_NPTR(bp, next);
+	 PUT_PREV(next, bp);
+      }
+      PUT_NEXT(prev, bp);
+      PUT_PPTR(bp, prev);
+      return;
+   }
 
    /* If list isn't empty */
    if (GET(free_list) != (size_t)0){    				
@@ -385,6 +1497,7 @@ void lifo_insert(void *bp){
    /* In any case */
    PUT(free_list, (size_t)bp);                // Set free list start pointer
    CLEAR_PREV(bp);       	              // Set current prev pointer
+   BIN_SET(size_bin);
 }
 
 /*
@@ -398,6 +1511,18 @@ void remove_from_list(void *bp){
    int size_bin;
    size_bin = find_size_bin(GET_SIZE(HDR(bp)));
    free_list = (char *)(FULL_HEAP + (size_bin*WSIZE));
+   free_bytes -= GET_SIZE(HDR(bp));
+   if (rover[size_bin] == bp){
+      rover[size_bin] = NEXTP(GET(bp));
+   }
+
+#ifndef TLSF
+   /* Largest bin is a treap */
+   if (size_bin == NO_LISTS-1){
+      PUT(free_list, (size_t)tree_remove((char *)GET(free_list), bp));
+      return;
+   }
+#endif
 
    /* If block exists behind */
    if (PREVP(GET(bp)) != 0 ){
@@ -427,139 +1552,2039 @@ void remove_from_list(void *bp){
       if (NEXTP(GET(bp)) != 0 ){
 	 CLEAR_PREV(NEXTP(GET(bp)));
       }
+      else {
+	 BIN_CLEAR(size_bin);
+      }
    }
 }
 
+#ifndef TLSF
 /*
- * free - Frees allocated block, takes its pointer.
- * Calls functions for list manipulation.
+ * set_left/set_right - Point the left/right treap link of bp at child,
+ * which may be NULL.
  */
-void free (void *bp) {
-   if(!bp) return;
-   
-   size_t size = (GET_SIZE(HDR(bp)));
-   PUT_INT(HDR(bp), PACK(size,0));
-   PUT_INT(FTR(bp), PACK(size, 0));
-   
-   // Coalesce calls the free list manipulating functions
-   coalesce(bp);
+static void set_left(char *bp, char *child){
+   CLEAR_PREV(bp);
+   if (child != NULL){
+      PUT_PPTR(bp, child);
+   }
+}
+
+static void set_right(char *bp, char *child){
+   CLEAR_NEXT(bp);
+   if (child != NULL){
+      PUT_NPTR(bp, child);
+   }
 }
 
 /*
- * coalesce - Coalesce freed block with adjacent free blocks. Removes 
- * blocks and inserts/reinserts them depending upon coalescing conditions.
- * WARNING! Behaviour of mm_checkheap as a debugger when called from this
- * function is only defined when coalescence checking is turned off. 
+ * tree_insert - Inserts block bp into the treap rooted at root and returns
+ * the new root. Rotations on the way back up restore the heap order of the
+ * address based priorities.
  */
-void *coalesce(void *bp){
-   size_t prev_alloc = GET_ALLOC(FTR(PREV_BLK(bp)));
-   size_t next_alloc = GET_ALLOC(HDR(NEXT_BLK(bp)));
-   unsigned size = GET_SIZE(HDR(bp));
-
-   // No coalescing required, simply inserts current
-   if(prev_alloc && next_alloc){
-      lifo_insert(bp);
+static char *tree_insert(char *root, char *bp){
+   char *child;
+   if (root == NULL){
       return bp;
    }
-
-   // Removes next from list, coalesces with current and inserts current
-   else if (prev_alloc && !next_alloc){
-      remove_from_list(NEXT_BLK(bp));
-      size += GET_SIZE(HDR(NEXT_BLK(bp)));
-      PUT_INT(HDR(bp), PACK(size, 0));
-      PUT_INT(FTR(bp), PACK(size, 0));
-      lifo_insert(bp);
-      return bp;
+   if (TREE_LESS(bp, root)){
+      child = tree_insert(LEFT(root), bp);
+      set_left(root, child);
+      if (PRIO(child) > PRIO(root)){
+	 set_left(root, RIGHT(child));
+	 set_right(child, root);
+	 return child;
+      }
    }
-
+   else {
+      child = tree_insert(RIGHT(root), bp);
+      set_right(root, child);
+      if (PRIO(child) > PRIO(root)){
+	 set_right(root, LEFT(child));
+	 set_left(child, root);
+	 return child;
+      }
+   }
+   return root;
+}
+
+/*
+ * tree_remove - Removes block bp from the treap rooted at root and returns
+ * the new root. The block is located by its (size, address) key, so its
+ * header must not have been changed yet.
+ */
+static char *tree_remove(char *root, char *bp){
+   if (root == bp){
+      return tree_merge(LEFT(root), RIGHT(root));
+   }
+   if (TREE_LESS(bp, root)){
+      set_left(root, tree_remove(LEFT(root), bp));
+   }
+   else {
+      set_right(root, tree_remove(RIGHT(root), bp));
+   }
+   return root;
+}
+
+/*
+ * tree_merge - Joins two treaps where every key in left is smaller than
+ * every key in right, keeping the higher priority node on top.
+ */
+static char *tree_merge(char *left, char *right){
+   if (left == NULL){
+      return right;
+   }
+   if (right == NULL){
+      return left;
+   }
+   if (PRIO(left) > PRIO(right)){
+      set_right(left, tree_merge(RIGHT(left), right));
+      return left;
+   }
+   set_left(right, tree_merge(left, LEFT(right)));
+   return right;
+}
+#endif /* ndef TLSF */
+
+/*
+ * free - Frees allocated block, takes its pointer. Blocks with a payload of
+ * up to CACHE_MAX bytes are pushed onto the calling thread's cache, which is
+ * flushed back to the shared heap once it grows past CACHE_LIMIT blocks.
+ * Mapped chunks are unmapped. Other blocks go to the heap, or to its inbox
+ * if another thread holds the heap lock.
+ */
+void free (void *bp) {
+   struct thread_cache *tc;
+   size_t size;
+   int cls;
+
+   if(!bp) return;
+   PROF_FREE(bp);
+
+   size = usable_size(bp);
+   if (size <= CACHE_MAX){
+      tc = tcache_get();
+      cls = size / ALIGNMENT;
+      CACHE_NEXT(bp) = tc->list[cls];
+      tc->list[cls] = bp;
+      tc->frees++;
+      if (++tc->count[cls] > CACHE_LIMIT){
+         tcache_flush(tc, cls, CACHE_LIMIT/2);
+      }
+      return;
+   }
+
+   if (GET_MMAPPED(HDR(bp))){
+      mmap_free(bp);
+      return;
+   }
+
+   if (pthread_mutex_trylock(&heap_lock) != 0){
+      remote_push(bp, bp, 1);
+      return;
+   }
+   remote_drain();
+   heap_free(bp);
+   HEAP_UNLOCK();
+}
+
+/*
+ * heap_free - Returns block bp to the shared heap, or to its slab if it is a
+ * slab object. Calls functions for list manipulation, and trims the heap once
+ * enough memory has been freed. Caller must hold the heap lock.
+ */
+void heap_free(void *bp) {
+   struct slab *s;
+   if ((s = slab_lookup(bp)) != NULL){
+      slab_free(s, bp);
+      return;
+   }
+
+   size_t size = (GET_SIZE(HDR(bp)));
+   stats.frees[find_size_bin(size)]++;
+
+   // Small blocks wait in a fast bin, still allocated
+   if (size <= FAST_MAX){
+      CACHE_NEXT(bp) = fast_bins[size / ALIGNMENT];
+      fast_bins[size / ALIGNMENT] = bp;
+      fast_bytes += size;
+      if (fast_bytes >= FAST_LIMIT){
+	 consolidate();
+      }
+   }
+   else {
+      PUT_HDR(bp, PACK(size,0));
+      PUT_INT(FTR(bp), PACK(size, 0));
+
+      // Coalesce calls the free list manipulating functions
+      coalesce(bp);
+      freed_since_trim += size;
+   }
+
+   if (freed_since_trim >= trim_threshold && free_bytes >= trim_threshold &&\
+	 !in_pressure){
+      heap_trim(0);
+   }
+}
+
+/*
+ * consolidate - Frees every block in the fast bins into the segregated
+ * lists, coalescing each with its free neighbours. Caller must hold the heap
+ * lock.
+ */
+static void consolidate(void){
+   char *bp;
+   size_t size;
+
+   if (fast_bytes == 0){
+      return;
+   }
+   stats.consolidations++;
+   for (int x = 0; x < NO_FAST; x++){
+      while ((bp = fast_bins[x]) != NULL){
+	 fast_bins[x] = CACHE_NEXT(bp);
+	 size = GET_SIZE(HDR(bp));
+	 PUT_HDR(bp, PACK(size, 0));
+	 PUT_INT(FTR(bp), PACK(size, 0));
+	 coalesce(bp);
+      }
+   }
+   freed_since_trim += fast_bytes;
+   fast_bytes = 0;
+}
+
+/*
+ * coalesce - Coalesce freed block with adjacent free blocks. Removes 
+ * blocks and inserts/reinserts them depending upon coalescing conditions.
+ * WARNING! Behaviour of mm_checkheap as a debugger when called from this
+ * function is only defined when coalescence checking is turned off. 
+ * The block keeps the trim mark of a neighbour at least its size, so that
+ * small frees at the edge of a large free area do not hold it back.
+ */
+void *coalesce(void *bp){
+   size_t prev_alloc = GET_PREV_ALLOC(HDR(bp));
+   size_t next_alloc = GET_ALLOC(HDR(NEXT_BLK(bp)));
+   size_t size = GET_SIZE(HDR(bp));
+   char *prev = prev_alloc ? NULL : PREV_BLK(bp);
+   char *next = NEXT_BLK(bp);
+   unsigned aged = 0;
+
+   // Neighbours that would make the block too big for its header stay apart
+   if (!prev_alloc && size + GET_SIZE(HDR(prev)) > MAX_BLOCK){
+      prev_alloc = 1;
+   }
+   if (!next_alloc && size + GET_SIZE(HDR(next)) +\
+	 (prev_alloc ? 0 : GET_SIZE(HDR(prev))) > MAX_BLOCK){
+      next_alloc = 1;
+   }
+
+   if (!prev_alloc && GET_SIZE(HDR(prev)) >= size){
+      aged |= GET_TRIM_AGED(FTR(prev));
+   }
+   if (!next_alloc && GET_SIZE(HDR(next)) >= size){
+      aged |= GET_TRIM_AGED(FTR(next));
+   }
+
+   // No coalescing required, simply inserts current
+   if(prev_alloc && next_alloc){
+      CLEAR_PREV_ALLOC(next);
+      lifo_insert(bp);
+      return bp;
+   }
+
+   // Removes next from list, coalesces with current and inserts current
+   else if (prev_alloc && !next_alloc){
+      stats.coalesces++;
+      remove_from_list(next);
+      size += GET_SIZE(HDR(next));
+      clear_stale(next);
+      DIRTY_DROP(next);
+      PUT_HDR(bp, PACK(size, 0));
+      PUT_INT(FTR(bp), PACK(size, aged));
+      CLEAR_PREV_ALLOC(NEXT_BLK(bp));
+      lifo_insert(bp);
+      return bp;
+   }
+
    // Removes current from list, coalesces with prev and inserts prev
    else if (!prev_alloc && next_alloc){
-      remove_from_list(PREV_BLK(bp));
-      size += GET_SIZE(HDR(PREV_BLK(bp)));
-      PUT_INT(HDR(PREV_BLK(bp)), PACK(size, 0));
-      PUT_INT(FTR(bp), PACK(size, 0));
-      lifo_insert(PREV_BLK(bp));
-      return (PREV_BLK(bp));
+      stats.coalesces++;
+      remove_from_list(prev);
+      size += GET_SIZE(HDR(prev));
+      PUT_HDR(prev, PACK(size, 0));
+      PUT_INT(FTR(prev), PACK(size, aged));
+      CLEAR_PREV_ALLOC(next);
+      clear_stale(bp);
+      DIRTY_DROP(bp);
+      lifo_insert(prev);
+      return prev;
+   }
+
+   // Removes next and prev, coalesces with current and inserts prev
+   else {
+      stats.coalesces += 2;
+      remove_from_list(prev);
+      remove_from_list(next);
+      size += GET_SIZE(HDR(prev)) + GET_SIZE(HDR(next));
+      PUT_HDR(prev, PACK(size, 0));
+      PUT_INT(FTR(prev), PACK(size, aged));
+      CLEAR_PREV_ALLOC(NEXT_BLK(prev));
+      clear_stale(bp);
+      clear_stale(next);
+      DIRTY_DROP(bp);
+      DIRTY_DROP(next);
+      lifo_insert(prev);
+      return prev;
+   }
+}
+/*
+ * realloc - Reallocate existing block and data to a new block. Small blocks
+ * that still hold size bytes without wasting more than half are kept, other
+ * blocks that belong to the thread caches on either side are moved with
+ * malloc and free. Mapped chunks are resized by mmap_realloc. Everything
+ * else is first resized in place under the heap lock, and only moved if that
+ * fails, to a mapped chunk if it has grown past mmap_threshold and within
+ * the shared heap otherwise. The profiler sees the call as a free of the
+ * old block and an allocation of the new one, whatever happens inside.
+ */
+void *realloc(void *oldptr, size_t size) {
+   char *bp;
+
+   if (sample_rate == 0 && prof_live == 0){
+      return realloc_block(oldptr, size);
+   }
+
+   /* The old block is forgotten before its address can be reused. If the
+    * call fails it stays allocated, but unsampled */
+   if (oldptr != NULL){
+      PROF_FREE(oldptr);
+   }
+   prof_busy++;
+   bp = realloc_block(oldptr, size);
+   prof_busy--;
+   return PROF_ALLOC(bp, size);
+}
+
+/*
+ * realloc_block - Does the work of realloc.
+ */
+static void *realloc_block(void *oldptr, size_t size) {
+   size_t oldsize, asize;
+   size_t old_usable;
+   char *bp;
+   size_t buff[1];
+   size_t* buffer = buff; 
+   unsigned tail;
+
+   /* Adjust block size */
+   if (size <= MIN_SIZE - HSIZE)
+      asize = MIN_SIZE;
+   else
+      asize = ALIGN(size + HSIZE);
+
+   /* If size == 0 then this is just free, and we return NULL. */
+   if(size == 0) {
+      free(oldptr);
+      return NULL;
+   }
+
+   /* If oldptr is NULL, then this is just malloc. */
+   if(oldptr == NULL) {
+      return malloc(size);
+   }
+
+   if (size > MAX_BLOCK - DWSIZE && size < mmap_threshold){
+      errno = ENOMEM;
+      return NULL;
+   }
+
+   /* Cached sizes on either side, move through the thread cache */
+   old_usable = usable_size(oldptr);
+   if (size <= CACHE_MAX || old_usable <= CACHE_MAX){
+      if (size <= old_usable && old_usable <= CACHE_MAX &&
+	    size > old_usable / 2){
+         return oldptr;
+      }
+      if ((bp = malloc(size)) == NULL){
+         return NULL;
+      }
+      memcpy(bp, oldptr, MIN(size, old_usable));
+      free(oldptr);
+      return bp;
+   }
+
+   if (GET_MMAPPED(HDR(oldptr))){
+      return mmap_realloc(oldptr, size);
+   }
+
+   /* Shrink, absorb the next block or extend the heap without moving */
+   HEAP_LOCK();
+   if (resize_in_place(oldptr, asize) != NULL){
+      HEAP_UNLOCK();
+      return oldptr;
+   }
+   HEAP_UNLOCK();
+
+   if (size >= mmap_threshold){
+      if ((bp = mmap_alloc(size)) == NULL){
+         return NULL;
+      }
+      memcpy(bp, oldptr, old_usable);
+      free(oldptr);
+      return bp;
+   }
+   HEAP_LOCK();
+
+   /* Save data that will be written over by free-list pointers and the
+    * footer */
+   oldsize = GET_SIZE(HDR(oldptr));
+   memcpy(buffer, oldptr, WSIZE); 
+   tail = GET_INT(FTR(oldptr));
+   
+   /* Unallocate previous block and search for fit as with malloc. This
+    * bypasses heap_free so that a trim can not drop the old contents */
+   stats.frees[find_size_bin(oldsize)]++;
+   PUT_HDR(oldptr, PACK(oldsize, 0));
+   PUT_INT(FTR(oldptr), PACK(oldsize, 0));
+   coalesce(oldptr);
+
+   if((bp = find_fit_all(asize)) == NULL){
+      if ((bp = extend_heap(asize)) == NULL){
+	 HEAP_UNLOCK();
+	 return NULL;
+      }
+   }
+   
+   /* Copy previous contents to new block. Only a grow gets here, so the
+    * whole old payload fits */
+   /* The new block may overlap the old one if it was coalesced into it */
+   memmove((char *)bp + WSIZE, (char *)oldptr + WSIZE, oldsize - HSIZE - WSIZE);
+   place(bp, asize);
+   HEAP_UNLOCK();
+   memcpy((char *)bp, (char *)buffer, WSIZE);
+   PUT_INT((char *)bp + oldsize - WSIZE, tail);
+   return bp;
+
+}
+
+/*
+ * resize_in_place - Resizes allocated block bp to asize bytes without moving
+ * it. A shrink splits off the tail. A grow absorbs the next block if it is
+ * free, extending the heap first if bp is the last allocated block. Returns
+ * bp, or NULL if the block can not grow in place. Caller must hold the heap
+ * lock.
+ */
+void *resize_in_place(void *bp, size_t asize){
+   size_t size = GET_SIZE(HDR(bp));
+   size_t avail = size;
+   char *next = NEXT_BLK(bp);
+
+   if (asize > size){
+      if (!GET_ALLOC(HDR(next))){
+	 avail += GET_SIZE(HDR(next));
+      }
+
+      /* Last block in the heap, grow the heap by what is missing */
+      if (avail < asize && (GET_SIZE(HDR(next)) == 0 ||\
+	       (!GET_ALLOC(HDR(next)) && GET_SIZE(HDR(NEXT_BLK(next))) == 0))){
+	 if (extend_heap(asize - size) == NULL){
+	    return NULL;
+	 }
+	 next = NEXT_BLK(bp);
+	 avail = size + GET_SIZE(HDR(next));
+      }
+      if (avail < asize){
+	 return NULL;
+      }
+
+      remove_from_list(next);
+      DIRTY_DROP(next);
+      MARK_USED((char *)bp + avail);
+      MARK_DIRTY(bp);
+      PUT_HDR(bp, PACK(avail, 1));
+      SET_PREV_ALLOC(NEXT_BLK(bp));
+   }
+   split_tail(bp, asize);
+   return bp;
+}
+
+/*
+ * split_tail - Shrinks allocated block bp to asize bytes if the leftover is
+ * big enough to be a block. The leftover is freed and coalesced with the
+ * block that follows it. Caller must hold the heap lock.
+ */
+void split_tail(void *bp, size_t asize){
+   size_t size = GET_SIZE(HDR(bp));
+   if ((size - asize) < MIN_SIZE){
+      return;
+   }
+   stats.splits++;
+   PUT_HDR(bp, PACK(asize, 1));
+   bp = NEXT_BLK(bp);
+   PUT_INT(HDR(bp), PACK(size - asize, PREV_ALLOC));
+   PUT_INT(FTR(bp), PACK(size - asize, 0));
+   coalesce(bp);
+}
+
+/*
+ * mmap_alloc - Gives a request of size bytes its own anonymous mapping. The
+ * mapping length and a header marked MMAPPED and allocated are stored in
+ * front of the payload. Returns NULL if the mapping fails.
+ */
+void *mmap_alloc(size_t size){
+   size_t len, page = getpagesize();
+   char *base;
+
+   len = (size + MMAP_OVERHEAD + page - 1) & ~(page - 1);
+   if (len < size){
+      errno = ENOMEM;
+      return NULL;
+   }
+   map_pressure(len);
+   base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,\
+	 -1, 0);
+   if (base == MAP_FAILED){
+      return NULL;
+   }
+   PUT(base, len);
+   PUT_INT(THIS(base + WSIZE), PACK(0, MMAPPED | 1));
+   __atomic_add_fetch(&stats.mmap_allocs, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&stats.mapped_bytes, len, __ATOMIC_RELAXED);
+   return base + MMAP_OVERHEAD;
+}
+
+/*
+ * mmap_free - Unmaps mapped chunk bp.
+ */
+void mmap_free(void *bp){
+   __atomic_add_fetch(&stats.mmap_frees, 1, __ATOMIC_RELAXED);
+   __atomic_sub_fetch(&stats.mapped_bytes, MMAP_LEN(bp), __ATOMIC_RELAXED);
+   munmap(MMAP_START(bp), MMAP_LEN(bp));
+}
+
+/*
+ * mmap_memalign - Maps a chunk of size bytes whose payload is a multiple of
+ * align, a power of two above DWSIZE. The mapping is made align bytes too
+ * long, and the pages in front of the one holding the length word and those
+ * past the payload are unmapped again. Returns NULL if the mapping fails.
+ */
+static void *mmap_memalign(size_t align, size_t size){
+   size_t len, page = getpagesize();
+   char *base, *bp, *start, *end;
+
+   len = (size + MMAP_OVERHEAD + align + page - 1) & ~(page - 1);
+   if (len < size){
+      errno = ENOMEM;
+      return NULL;
+   }
+   map_pressure(len);
+   base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,\
+	 -1, 0);
+   if (base == MAP_FAILED){
+      return NULL;
+   }
+
+   bp = (char *)(((size_t)base + MMAP_OVERHEAD + align - 1) & ~(align - 1));
+   start = MMAP_START(bp);
+   end = (char *)(((size_t)bp + size + page - 1) & ~(page - 1));
+   if (start > base){
+      munmap(base, start - base);
+   }
+   if (end < base + len){
+      munmap(end, base + len - end);
+   }
+   PUT(MMAP_BASE(bp), end - start);
+   PUT_INT(HDR(bp), PACK(0, MMAPPED | 1));
+   __atomic_add_fetch(&stats.mmap_allocs, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&stats.mapped_bytes, end - start, __ATOMIC_RELAXED);
+   return bp;
+}
+
+/*
+ * mmap_realloc - Resizes mapped chunk bp with mremap, which may move it
+ * without copying. The payload keeps its offset into the mapping. A chunk
+ * resized below mmap_threshold is moved back into the heap, which may mean
+ * growing it if the threshold was raised after it was mapped.
+ */
+void *mmap_realloc(void *bp, size_t size){
+   size_t len, page = getpagesize();
+   size_t lead = (char *)bp - MMAP_START(bp);
+   char *base, *newp;
+
+   if (size < mmap_threshold){
+      if ((newp = malloc(size)) == NULL){
+         return NULL;
+      }
+      memcpy(newp, bp, MIN(size, usable_size(bp)));
+      mmap_free(bp);
+      return newp;
+   }
+
+   len = (size + lead + page - 1) & ~(page - 1);
+   if (len < size){
+      errno = ENOMEM;
+      return NULL;
+   }
+   if (len == MMAP_LEN(bp)){
+      return bp;
+   }
+   if (len > MMAP_LEN(bp)){
+      map_pressure(len - MMAP_LEN(bp));
+   }
+   base = mremap(MMAP_START(bp), MMAP_LEN(bp), len, MREMAP_MAYMOVE);
+   if (base == MAP_FAILED){
+      return NULL;
+   }
+   newp = base + lead;
+   __atomic_add_fetch(&stats.mapped_bytes, len - MMAP_LEN(newp),\
+	 __ATOMIC_RELAXED);
+   MMAP_LEN(newp) = len;
+   return newp;
+}
+
+/*
+ * heap_trim - Releases the memory held by free blocks. The top of the heap is
+ * cut back if the backend allows it, and the whole pages inside every free
+ * block of at least TRIM_MIN bytes are dropped, skipping blocks released by
+ * an earlier trim. Unless all is set only blocks that were free at the
+ * previous trim as well are released, the others are marked for the next
+ * one. Returns the number of bytes released. Caller must hold the heap lock.
+ */
+size_t heap_trim(int all){
+   size_t released;
+   char *bp;
+
+   consolidate();
+   released = trim_top(all);
+   for (int x = find_size_bin(TRIM_MIN); x < NO_LISTS; x++){
+      bp = (char *)GET(FULL_HEAP + (x*WSIZE));
+#ifndef TLSF
+      if (x == NO_LISTS-1){
+	 released += release_tree(bp, all);
+	 continue;
+      }
+#endif
+      for (; bp != 0; bp = NEXTP(GET(bp))){
+	 released += release_pages(bp, all);
+      }
+   }
+   freed_since_trim = 0;
+   grow_step = MAX(grow_step / 2, GROW_MIN);
+   return released;
+}
+
+/*
+ * trim_top - Gives the whole pages of a free block at the top of the heap back
+ * through mem_sbrk, keeping a minimum sized block. Unless all is set the block
+ * must carry the mark release_pages left at the previous trim. Only built with
+ * HEAP_SHRINK, the driver's mem_sbrk refuses to shrink the heap. Returns the
+ * number of bytes released.
+ */
+static size_t trim_top(int all){
+#ifdef HEAP_SHRINK
+   char *bp = (char *)mem_heap_hi() + 1;
+   char *end;
+   size_t size, release;
+
+   if (GET_PREV_ALLOC(HDR(bp))){
+      return 0;
+   }
+   bp = PREV_BLK(bp);
+   size = GET_SIZE(HDR(bp));
+   release = (size - MIN_SIZE) & ~((size_t)getpagesize() - 1);
+   if (release == 0){
+      return 0;
+   }
+   if (!all && !GET_TRIM_AGED(FTR(bp))){
+      return 0;
+   }
+
+   remove_from_list(bp);
+   if (mem_sbrk(-(intptr_t)release) == (void *)-1){
+      lifo_insert(bp);
+      return 0;
+   }
+
+   /* Whatever the heap regrows into up to the old top counts as dirty */
+   MARK_USED((char *)mem_heap_hi() + 1 + release);
+   end = (char *)(((size_t)mem_heap_hi() + 1) & ~(HUGE_SIZE - 1));
+   if (huge_mark > end){
+      stats.huge_bytes -= huge_mark - end;
+      huge_mark = end;
+   }
+   PUT_HDR(bp, PACK(size - release, 0));
+   PUT_INT(FTR(bp), PACK(size - release, 0));
+   PUT_INT(HDR(NEXT_BLK(bp)), PACK(0, 1));
+   lifo_insert(bp);
+   return release;
+#else
+   (void)all;
+   return 0;
+#endif
+}
+
+/*
+ * release_pages - Drops the whole pages inside free block bp unless that was
+ * done already, and marks its header. Unless all is set a block that was not
+ * free at the previous trim is only marked in its footer. The header, the
+ * free list word and the footer lie outside the pages and are kept. Returns
+ * the number of bytes newly released, which leaves out the pages of a
+ * coalesced block that were released before and not touched since.
+ */
+static size_t release_pages(char *bp, int all){
+   size_t page = getpagesize();
+   size_t start = ((size_t)bp + WSIZE + page - 1) & ~(page - 1);
+   size_t end = ((size_t)bp + GET_SIZE(HDR(bp)) - WSIZE) & ~(page - 1);
+   size_t released;
+
+   if (end <= start || GET_RELEASED(HDR(bp))){
+      return 0;
+   }
+   if (!all && !GET_TRIM_AGED(FTR(bp))){
+      GET_INT(FTR(bp)) |= TRIM_AGED;
+      return 0;
+   }
+   released = resident_bytes(start, end);
+   if (madvise((void *)start, end - start, MADV_DONTNEED) < 0){
+      return 0;
+   }
+   GET_INT(HDR(bp)) |= RELEASED;
+   return released;
+}
+
+/*
+ * resident_bytes - Returns the bytes of the pages from start to end that are
+ * in memory, or all of them if mincore fails.
+ */
+static size_t resident_bytes(size_t start, size_t end){
+   unsigned char vec[1024];
+   size_t page = getpagesize(), bytes = 0, n;
+
+   for (; start < end; start += n * page){
+      n = MIN((end - start) / page, sizeof(vec));
+      if (mincore((void *)start, n * page, vec) < 0){
+	 return bytes + (end - start);
+      }
+      for (size_t x = 0; x < n; x++){
+	 bytes += (vec[x] & 1) ? page : 0;
+      }
+   }
+   return bytes;
+}
+
+#ifndef TLSF
+/*
+ * release_tree - Drops the whole pages inside every node of the treap
+ * rooted at bp, as release_pages does. Returns the number of bytes
+ * released.
+ */
+static size_t release_tree(char *bp, int all){
+   if (bp == NULL){
+      return 0;
+   }
+   return release_pages(bp, all) + release_tree(LEFT(bp), all) +\
+      release_tree(RIGHT(bp), all);
+}
+#endif
+
+/*
+ * mm_trim - Flushes the calling thread's cache and releases free memory to
+ * the system. Returns the number of bytes released.
+ */
+size_t mm_trim(void){
+   struct thread_cache *tc = tcache_get();
+   size_t released;
+
+   for (int cls = 0; cls < NO_CACHES; cls++){
+      tcache_flush(tc, cls, 0);
+   }
+   HEAP_LOCK();
+   released = heap_trim(1);
+   HEAP_UNLOCK();
+   return released;
+}
+
+/*
+ * mm_set_trim_threshold - Sets the free memory watermark for automatic
+ * trimming.
+ */
+void mm_set_trim_threshold(size_t bytes){
+   trim_threshold = bytes;
+}
+
+/*
+ * mm_set_mmap_threshold - Sets the request size from which allocations are
+ * mapped on their own.
+ */
+void mm_set_mmap_threshold(size_t bytes){
+   mmap_threshold = bytes;
+}
+
+/*
+ * mm_set_policy - Picks the placement policy and the free list order for
+ * the heap the next mm_init creates.
+ */
+void mm_set_policy(int fit, int order){
+   next_fit_policy = fit;
+   next_order_policy = order;
+}
+
+/*
+ * mm_set_check - Sets how builds with HEAP_CHECK check the heap on each
+ * release of the heap lock, and that only a random one in one_in releases
+ * is checked.
+ */
+void mm_set_check(int mode, unsigned one_in){
+   pthread_mutex_lock(&heap_lock);
+   check_mode = mode;
+   check_one_in = MAX(one_in, 1);
+#ifdef HEAP_CHECK
+   ndirty = 0;
+#endif
+   pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * mm_stats - Copies the counters into st, after folding in the calling
+ * thread's cache hits. Heap blocks that are not in the free lists, which
+ * includes cached blocks and slabs, count as live.
+ */
+void mm_stats(struct mm_stats *st){
+   struct thread_cache *tc = tcache_get();
+
+   pthread_mutex_lock(&heap_lock);
+   tcache_fold(tc);
+   *st = stats;
+   st->heap_size = mem_heapsize();
+   st->free_bytes = free_bytes;
+   st->live_bytes = (char *)mem_heap_hi() + 1 - (heap + WSIZE) - free_bytes;
+   pthread_mutex_unlock(&heap_lock);
+   st->mapped_bytes = __atomic_load_n(&stats.mapped_bytes, __ATOMIC_RELAXED);
+   st->remote_frees = __atomic_load_n(&stats.remote_frees, __ATOMIC_RELAXED);
+}
+
+/*
+ * clear_stale - Clears the header word and first word of block bp, which has
+ * just been coalesced into the block in front of it, if they lie above
+ * fresh_mark. Memory there then reads as zero again, as calloc expects.
+ */
+static void clear_stale(char *bp){
+#ifdef HEAP_ZEROED
+   if (FULL_HDR(bp) >= fresh_mark){
+      PUT(FULL_HDR(bp), (size_t)0);
+   }
+   if (bp >= fresh_mark){
+      PUT(bp, (size_t)0);
+   }
+#else
+   (void)bp;
+#endif
+}
+
+/*
+ * calloc - Allocates a block of nmemb * size bytes, intialized to zero.
+ * Returns NULL with ENOMEM if the product overflows. Mapped chunks are
+ * fresh and are not cleared. Heap blocks are only cleared below fresh_mark
+ * and in their first word and old footer, see clear_stale, when the heap is
+ * known to be zero filled.
+ */
+void *calloc (size_t nmemb, size_t size) {
+   size_t bytes, dirty;
+   char *bp, *clean;
+
+   if (__builtin_mul_overflow(nmemb, size, &bytes)){
+      errno = ENOMEM;
+      return NULL;
+   }
+   if (bytes == 0 || !HEAP_READY())
+      return NULL;
+
+   if (bytes >= mmap_threshold && bytes > CACHE_MAX){
+      return PROF_ALLOC(mmap_alloc(bytes), bytes);
+   }
+   if (bytes <= CACHE_MAX){
+      prof_busy++;
+      bp = malloc(bytes);
+      prof_busy--;
+      if (bp != NULL){
+	 memset(bp, 0, bytes);
+      }
+      return PROF_ALLOC(bp, bytes);
+   }
+
+   HEAP_LOCK();
+   clean = fresh_mark;
+   bp = heap_malloc(bytes);
+   HEAP_UNLOCK();
+   if (bp == NULL){
+      return NULL;
+   }
+
+#ifdef HEAP_ZEROED
+   dirty = (clean > bp) ? MIN(bytes, MAX((size_t)(clean - bp), WSIZE)) : WSIZE;
+   /* The footer of the free block bp was carved from may be in the payload */
+   PUT_INT(FTR(bp), 0);
+#else
+   (void)clean;
+   dirty = bytes;
+#endif
+   memset(bp, 0, dirty);
+   return PROF_ALLOC(bp, bytes);
+}
+
+/*
+ * memalign - Allocates size bytes at an address that is a multiple of align,
+ * which must be a power of two. Large requests get an aligned mapping, the
+ * rest an aligned block split out of a free block by heap_memalign. Returns
+ * NULL with EINVAL for a bad alignment.
+ */
+void *memalign(size_t align, size_t size){
+   char *bp;
+
+   if (align == 0 || (align & (align - 1)) != 0){
+      errno = EINVAL;
+      return NULL;
+   }
+   if (align <= ALIGNMENT){
+      prof_busy++;
+      bp = malloc(size);
+      prof_busy--;
+      return PROF_ALLOC(bp, size);
+   }
+   if (size == 0 || !HEAP_READY())
+      return NULL;
+
+   if (size >= mmap_threshold){
+      bp = (align <= DWSIZE) ? mmap_alloc(size) : mmap_memalign(align, size);
+      return PROF_ALLOC(bp, size);
+   }
+   HEAP_LOCK();
+   bp = heap_memalign(align, size);
+   HEAP_UNLOCK();
+   return PROF_ALLOC(bp, size);
+}
+
+/*
+ * posix_memalign - Stores size bytes aligned to align, a power of two
+ * multiple of sizeof(void *), in memptr. Returns EINVAL for a bad alignment
+ * and ENOMEM if out of memory.
+ */
+int posix_memalign(void **memptr, size_t align, size_t size){
+   void *bp;
+
+   if (align == 0 || align % sizeof(void *) != 0 ||\
+	 (align & (align - 1)) != 0)
+      return EINVAL;
+   if (size == 0){
+      *memptr = NULL;
+      return 0;
+   }
+   if ((bp = memalign(align, size)) == NULL)
+      return ENOMEM;
+   *memptr = bp;
+   return 0;
+}
+
+/*
+ * aligned_alloc - C11 name for memalign.
+ */
+void *aligned_alloc(size_t align, size_t size){
+   return memalign(align, size);
+}
+
+/*
+ * malloc_usable_size - Returns the bytes usable at bp, which may be more
+ * than were asked for, or 0 for NULL.
+ */
+size_t malloc_usable_size(void *bp){
+   return (bp == NULL) ? 0 : usable_size(bp);
+}
+
+#ifdef MM_PRELOAD
+/*
+ * valloc, pvalloc - Page aligned allocation, pvalloc also rounds the size up
+ * to whole pages. Defined so that the C library's versions never hand out
+ * memory of their own.
+ */
+void *valloc(size_t size){
+   return memalign(getpagesize(), size);
+}
+
+void *pvalloc(size_t size){
+   size_t page = getpagesize();
+
+   if (size > (size_t)-1 - page){
+      errno = ENOMEM;
+      return NULL;
+   }
+   return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+/*
+ * mem_sbrk - Moves the program break by incr bytes and returns the old
+ * break, or (void *)-1 with errno set. The first call aligns the break to
+ * DWSIZE. The heap has to stay contiguous, so this fails with ENOMEM once
+ * something else has moved the break.
+ */
+static void *mem_sbrk(intptr_t incr){
+   char *old;
+
+   if (mem_start == NULL){
+      if ((old = sbrk(0)) == (void *)-1 ||\
+	    sbrk(-(intptr_t)old & (DWSIZE - 1)) == (void *)-1){
+	 return (void *)-1;
+      }
+      mem_start = mem_brk = sbrk(0);
+   }
+   if (sbrk(0) != mem_brk){
+      errno = ENOMEM;
+      return (void *)-1;
+   }
+   if ((old = sbrk(incr)) == (void *)-1){
+      return old;
+   }
+   mem_brk = old + incr;
+   return old;
+}
+
+/*
+ * mem_heap_lo, mem_heap_hi, mem_heapsize - First and last byte of the heap
+ * and its size, as memlib reports them.
+ */
+static void *mem_heap_lo(void){
+   return mem_start;
+}
+
+static void *mem_heap_hi(void){
+   return mem_brk - 1;
+}
+
+static size_t mem_heapsize(void){
+   return mem_brk - mem_start;
+}
+
+/*
+ * preload_init - Initializes the heap once, for the first allocation of the
+ * process. Returns 0 with ENOMEM if there is no heap.
+ */
+static int preload_init(void){
+   pthread_once(&heap_once, heap_init_once);
+   if (heap == NULL){
+      errno = ENOMEM;
+      return 0;
+   }
+   return 1;
+}
+
+static void heap_init_once(void){
+   const char *policy = getenv("MM_POLICY");
+
+   /* MM_POLICY names a placement policy and a list order, "best,address" */
+   if (policy != NULL){
+      mm_set_policy(strstr(policy, "next") ? MM_FIT_NEXT :\
+	    strstr(policy, "best") ? MM_FIT_BEST :\
+	    strstr(policy, "good") ? MM_FIT_GOOD : MM_FIT_FIRST,\
+	    strstr(policy, "address") ? MM_ORDER_ADDRESS : MM_ORDER_LIFO);
+   }
+   mm_init();
+   if (heap != NULL){
+      pthread_atfork(fork_prepare, fork_parent, fork_child);
+   }
+
+   /* MM_PROFILE is the sample rate in bytes */
+   if (getenv("MM_PROFILE") != NULL){
+      mm_set_sample_rate(strtoul(getenv("MM_PROFILE"), NULL, 10));
+   }
+}
+
+/*
+ * fork_prepare, fork_parent, fork_child - Fork handlers. The profiler and
+ * heap locks are held across fork() so that the child never sees the heap
+ * or the profile mid update.
+ */
+static void fork_prepare(void){
+   pthread_mutex_lock(&prof_lock);
+   pthread_mutex_lock(&heap_lock);
+}
+
+static void fork_parent(void){
+   pthread_mutex_unlock(&heap_lock);
+   pthread_mutex_unlock(&prof_lock);
+}
+
+static void fork_child(void){
+   pthread_mutex_unlock(&heap_lock);
+   pthread_mutex_unlock(&prof_lock);
+}
+
+/*
+ * profile_exit - Writes the heap profile to MM_PROFILE_OUT, with the pid
+ * appended, when the process exits.
+ */
+static void profile_exit(void){
+   const char *path = getenv("MM_PROFILE_OUT");
+   char name[4096];
+   int fd;
+
+   if (path == NULL || (sample_rate == 0 && prof_live == 0)){
+      return;
+   }
+   snprintf(name, sizeof(name), "%s.%d", path, (int)getpid());
+   if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0){
+      return;
+   }
+   mm_profile_dump(fd, MM_PROFILE_PPROF);
+   close(fd);
+}
+#endif
+
+/*
+ * mm_malloc_batch - Allocates n blocks of size bytes into out and returns how
+ * many were allocated, fewer than n only if memory ran out. Cached sizes are
+ * first taken from the calling thread's cache. The rest are allocated under
+ * a single acquisition of the heap lock, from slabs for slab sized requests
+ * and otherwise carved side by side out of as few free blocks as possible.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out){
+   struct thread_cache *tc;
+   size_t got = 0, k;
+   int cls;
+
+   if (size == 0 || !HEAP_READY())
+      return 0;
+   if (size >= mmap_threshold && size > CACHE_MAX){
+      for (; got < n; got++){
+         if ((out[got] = mmap_alloc(size)) == NULL)
+            break;
+      }
+      return (sample_rate != 0) ?\
+	 prof_batch(out, got, size, __builtin_return_address(0)) : got;
+   }
+
+   if (size <= CACHE_MAX){
+      tc = tcache_get();
+      cls = CACHE_CLASS(size);
+      for (; got < n && tc->list[cls] != NULL; got++){
+         out[got] = tc->list[cls];
+         tc->list[cls] = CACHE_NEXT(out[got]);
+         tc->count[cls]--;
+         tc->allocs++;
+      }
+   }
+
+   HEAP_LOCK();
+   if (size <= SLAB_MAX){
+      for (; got < n; got++){
+         if ((out[got] = slab_alloc(size)) == NULL)
+            break;
+      }
+   }
+   else {
+      for (; got < n; got += k){
+         if ((k = heap_carve(size, n - got, out + got)) == 0)
+            break;
+      }
+   }
+   HEAP_UNLOCK();
+   return (sample_rate != 0) ?\
+      prof_batch(out, got, size, __builtin_return_address(0)) : got;
+}
+
+/*
+ * heap_carve - Carves up to n blocks for requests of size bytes out of a
+ * single free block and stores them in out. The free block is one that
+ * holds all n if there is one, otherwise any that holds at least one, and
+ * otherwise the heap is grown. The blocks are laid out back to back with one
+ * list removal and at most one split. Returns the number of blocks carved,
+ * 0 if memory ran out. Caller must hold the heap lock.
+ */
+static size_t heap_carve(size_t size, size_t n, void **out){
+   size_t asize, want, bsize, rest, k;
+   char *bp, *last;
+
+   if (size > MAX_BLOCK - DWSIZE){
+      errno = ENOMEM;
+      return 0;
+   }
+   if (size <= MIN_SIZE - HSIZE)
+      asize = MIN_SIZE;
+   else
+      asize = ALIGN(size + HSIZE);
+
+   want = MIN(n, MAX_BLOCK / asize) * asize;
+   if ((bp = find_fit(want)) == NULL && (bp = find_fit_all(asize)) == NULL){
+      if ((bp = extend_heap(want)) == NULL){
+	 return 0;
+      }
+   }
+
+   bsize = GET_SIZE(HDR(bp));
+   k = MIN(n, bsize / asize);
+   rest = bsize - k * asize;
+   remove_from_list(bp);
+   stats.allocs[find_size_bin(asize)] += k;
+
+   /* Only the first block follows a block that may be free */
+   PUT_HDR(bp, PACK(asize, 1));
+   out[0] = bp;
+   MARK_DIRTY(bp);
+   for (size_t x = 1; x < k; x++){
+      out[x] = bp + x * asize;
+      PUT_INT(HDR(out[x]), PACK(asize, PREV_ALLOC | 1));
+      MARK_DIRTY(out[x]);
+   }
+   last = out[k - 1];
+
+   /* Split off the rest, or let the last block absorb it */
+   if (rest >= MIN_SIZE){
+      stats.splits++;
+      bp = last + asize;
+      PUT_INT(HDR(bp), PACK(rest, PREV_ALLOC));
+      PUT_INT(FTR(bp), PACK(rest, GET_TRIM_AGED(FTR(bp))));
+      lifo_insert(bp);
+   }
+   else {
+      PUT_HDR(last, PACK(asize + rest, 1));
+      SET_PREV_ALLOC(NEXT_BLK(last));
+   }
+   MARK_USED(last + GET_SIZE(HDR(last)));
+   return k;
+}
+
+/*
+ * mm_free_batch - Frees the n pointers in ptrs, any of which may be NULL.
+ * Cached sizes go to the calling thread's cache and mapped chunks are
+ * unmapped as with free. The other blocks are sorted by address, which
+ * reorders ptrs, and are freed under a single acquisition of the heap lock.
+ * Each run of neighbouring blocks is turned into one free block and
+ * coalesced once.
+ */
+void mm_free_batch(void **ptrs, size_t n){
+   size_t x, y, total;
+   char *bp;
+
+   for (x = 0; x < n; x++){
+      if (ptrs[x] != NULL && (usable_size(ptrs[x]) <= CACHE_MAX ||\
+	       GET_MMAPPED(HDR(ptrs[x])))){
+	 free(ptrs[x]);
+	 ptrs[x] = NULL;
+      }
+      else if (ptrs[x] != NULL){
+	 PROF_FREE(ptrs[x]);
+      }
+   }
+   qsort(ptrs, n, sizeof(void *), cmp_ptr);
+
+   HEAP_LOCK();
+   for (x = 0; x < n; x = y){
+      y = x + 1;
+      if ((bp = ptrs[x]) == NULL){
+	 continue;
+      }
+      total = GET_SIZE(HDR(bp));
+      stats.frees[find_size_bin(total)]++;
+      for (; y < n && (char *)ptrs[y] == bp + total &&\
+	    total + GET_SIZE(HDR(ptrs[y])) <= MAX_BLOCK; y++){
+	 stats.frees[find_size_bin(GET_SIZE(HDR(ptrs[y])))]++;
+	 total += GET_SIZE(HDR(ptrs[y]));
+	 DIRTY_DROP(ptrs[y]);
+      }
+      PUT_HDR(bp, PACK(total, 0));
+      PUT_INT(FTR(bp), PACK(total, 0));
+      coalesce(bp);
+      freed_since_trim += total;
+   }
+   if (freed_since_trim >= trim_threshold && free_bytes >= trim_threshold &&\
+	 !in_pressure){
+      heap_trim(0);
+   }
+   HEAP_UNLOCK();
+}
+
+/*
+ * mm_arena_create - Returns a new empty arena whose chunks hold chunk_size
+ * bytes, ARENA_CHUNK if chunk_size is 0. Returns NULL if out of memory.
+ */
+struct mm_arena *mm_arena_create(size_t chunk_size){
+   struct mm_arena *a;
+   if ((a = malloc(sizeof(struct mm_arena))) == NULL)
+      return NULL;
+   a->chunks = NULL;
+   a->current = NULL;
+   a->cur = NULL;
+   a->end = NULL;
+   a->chunk_size = chunk_size ? ALIGN(chunk_size) : ARENA_CHUNK;
+   return a;
+}
+
+/*
+ * mm_arena_alloc - Returns size bytes from arena a, aligned to ALIGNMENT.
+ * The current chunk is bumped, or replaced by a new chunk once it is full.
+ * Requests larger than a quarter chunk get a chunk of their own so that the
+ * current chunk is not abandoned early. Returns NULL if size is 0 or memory
+ * ran out.
+ */
+void *mm_arena_alloc(struct mm_arena *a, size_t size){
+   struct arena_chunk *c;
+   char *bp;
+
+   if (size == 0 || size > MAX_BLOCK)
+      return NULL;
+   size = ALIGN(size);
+   if (size <= (size_t)(a->end - a->cur)){
+      bp = a->cur;
+      a->cur += size;
+      return bp;
+   }
+
+   if (size > a->chunk_size / 4){
+      if ((c = malloc(sizeof(struct arena_chunk) + size)) == NULL)
+	 return NULL;
+      c->next = a->chunks;
+      a->chunks = c;
+      return c->data;
+   }
+
+   if ((c = malloc(sizeof(struct arena_chunk) + a->chunk_size)) == NULL)
+      return NULL;
+   c->next = a->chunks;
+   a->chunks = c;
+   a->current = c;
+   a->cur = c->data + size;
+   a->end = c->data + a->chunk_size;
+   return c->data;
+}
+
+/*
+ * mm_arena_reset - Frees everything allocated from arena a. Every chunk but
+ * the current one is freed, and that one is reused from its start.
+ */
+void mm_arena_reset(struct mm_arena *a){
+   struct arena_chunk *c, *next;
+   for (c = a->chunks; c != NULL; c = next){
+      next = c->next;
+      if (c != a->current)
+	 free(c);
+   }
+   a->chunks = a->current;
+   if (a->current != NULL){
+      a->current->next = NULL;
+      a->cur = a->current->data;
+   }
+}
+
+/*
+ * mm_arena_destroy - Frees arena a and all of its chunks.
+ */
+void mm_arena_destroy(struct mm_arena *a){
+   struct arena_chunk *c, *next;
+   for (c = a->chunks; c != NULL; c = next){
+      next = c->next;
+      free(c);
+   }
+   free(a);
+}
+
+/*
+ * mm_set_sample_rate - Samples about one allocation per rate bytes
+ * allocated, 0 turns sampling off. Blocks sampled before are still tracked
+ * until they are freed.
+ */
+void mm_set_sample_rate(size_t rate){
+   sample_rate = MIN(rate, (size_t)LONG_MAX / 2);
+   sample_left = 0;
+}
+
+/*
+ * prof_alloc - Counts size bytes allocated at bp against the calling
+ * thread's countdown and samples bp once it runs out. caller is the return
+ * address of the allocator's entry point. Returns bp.
+ */
+static void *prof_alloc(void *bp, size_t size, void *caller){
+   if (bp == NULL || prof_busy){
+      return bp;
+   }
+   if ((sample_left -= (long)MIN(size, (size_t)LONG_MAX / 2)) >= 0){
+      return bp;
+   }
+   return prof_sample(bp, size, caller);
+}
+
+/*
+ * prof_sample - Records block bp of size bytes as sampled at the calling
+ * stack. The sample stands for the bytes of every interval the countdown
+ * crossed, and for that many bytes over size allocations of its size. The
+ * next interval is drawn uniformly from 1 to twice the rate. The stack is
+ * cut at caller, the frames above it belong to the allocator and may be
+ * missing where it tail calls. Returns bp.
+ */
+static void *prof_sample(void *bp, size_t size, void *caller){
+   void *trace[PROF_DEPTH + PROF_SKIP], **pc;
+   struct prof_stack *st;
+   struct prof_sample *s;
+   size_t rate = sample_rate, bytes = 0, h = 0;
+   int depth, skip, b;
+
+   if (rate == 0){
+      sample_left = 0;
+      return bp;
+   }
+   /* A thread's first interval starts at its first allocation */
+   if (prof_seed == 0){
+      prof_seed = (unsigned long)&prof_seed | 1;
+      sample_left += rate;
+      if (sample_left >= 0)
+	 return bp;
+   }
+   while (sample_left < 0){
+      prof_seed ^= prof_seed << 13;
+      prof_seed ^= prof_seed >> 7;
+      prof_seed ^= prof_seed << 17;
+      sample_left += 1 + prof_seed % (2 * rate);
+      bytes += rate;
+   }
+
+   /* backtrace may allocate the first time it runs */
+   prof_busy++;
+   depth = backtrace(trace, PROF_DEPTH + PROF_SKIP);
+   for (skip = 0; skip < MIN(depth, PROF_SKIP) && trace[skip] != caller;\
+	 skip++);
+   if (skip == MIN(depth, PROF_SKIP)){
+      skip = MIN(depth, 1);
+   }
+   pc = trace + skip;
+   depth = MIN(depth - skip, PROF_DEPTH);
+   for (int x = 0; x < depth; x++){
+      h = h * 31 + (size_t)pc[x];
+   }
+
+   pthread_mutex_lock(&prof_lock);
+   for (st = prof_stacks[h % PROF_STACKS]; st != NULL; st = st->next){
+      if (st->depth == depth &&\
+	    memcmp(st->pc, pc, depth * sizeof(void *)) == 0){
+	 break;
+      }
+   }
+   if (st == NULL && (st = prof_carve(sizeof(*st))) != NULL){
+      st->depth = depth;
+      memcpy(st->pc, pc, depth * sizeof(void *));
+      st->next = prof_stacks[h % PROF_STACKS];
+      prof_stacks[h % PROF_STACKS] = st;
+   }
+   if ((s = prof_spare) != NULL){
+      prof_spare = s->next;
+   }
+   else {
+      s = prof_carve(sizeof(*s));
+   }
+   if (st != NULL && s != NULL){
+      b = ((size_t)bp >> 4) % PROF_BUCKETS;
+      s->bp = bp;
+      s->stack = st;
+      s->bytes = bytes;
+      s->count = MAX(bytes / MAX(size, 1), 1);
+      st->live_bytes += s->bytes;
+      st->total_bytes += s->bytes;
+      st->live_count += s->count;
+      st->total_count += s->count;
+      s->next = prof_samples[b];
+      __atomic_store_n(&prof_samples[b], s, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&prof_live, 1, __ATOMIC_RELAXED);
+   }
+   pthread_mutex_unlock(&prof_lock);
+   prof_busy--;
+   return bp;
+}
+
+/*
+ * prof_free - Takes block bp, which is about to be freed, out of the live
+ * tallies if it was sampled. The lock is only taken if the hash chain of bp
+ * is non empty. A sampled block is linked before it is returned to the
+ * program, so the chain of a block being freed is never seen empty early.
+ */
+static void prof_free(void *bp){
+   struct prof_sample *s, **link;
+   int b = ((size_t)bp >> 4) % PROF_BUCKETS;
+
+   if (prof_busy ||\
+	 __atomic_load_n(&prof_samples[b], __ATOMIC_RELAXED) == NULL){
+      return;
+   }
+   pthread_mutex_lock(&prof_lock);
+   for (link = &prof_samples[b]; (s = *link) != NULL; link = &s->next){
+      if (s->bp == bp){
+	 __atomic_store_n(link, s->next, __ATOMIC_RELAXED);
+	 s->stack->live_bytes -= s->bytes;
+	 s->stack->live_count -= s->count;
+	 s->next = prof_spare;
+	 prof_spare = s;
+	 __atomic_sub_fetch(&prof_live, 1, __ATOMIC_RELAXED);
+	 break;
+      }
+   }
+   pthread_mutex_unlock(&prof_lock);
+}
+
+/*
+ * prof_batch - Counts the got blocks of size bytes in out against the
+ * countdown, as allocated from caller. Returns got.
+ */
+static size_t prof_batch(void **out, size_t got, size_t size, void *caller){
+   for (size_t x = 0; x < got; x++){
+      prof_alloc(out[x], size, caller);
    }
+   return got;
+}
 
-   // Removes next and prev, coalesces with current and inserts prev
+/*
+ * prof_carve - Returns size bytes for a profiler record, carved out of a
+ * PROF_CHUNK mapping, or NULL if none can be mapped. Records are never
+ * unmapped. Caller must hold prof_lock.
+ */
+static void *prof_carve(size_t size){
+   char *p;
+
+   size = ALIGN(size);
+   if ((size_t)(prof_pool_end - prof_pool) < size){
+      p = mmap(NULL, PROF_CHUNK, PROT_READ | PROT_WRITE,\
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED){
+	 return NULL;
+      }
+      prof_pool = p;
+      prof_pool_end = p + PROF_CHUNK;
+   }
+   p = prof_pool;
+   prof_pool += size;
+   return p;
+}
+
+/*
+ * prof_reset - Forgets the sampled blocks, whose heap is being replaced.
+ * The tallies since the profiler started are kept.
+ */
+static void prof_reset(void){
+   struct prof_sample *s, *next;
+   struct prof_stack *st;
+
+   pthread_mutex_lock(&prof_lock);
+   for (int b = 0; b < PROF_BUCKETS; b++){
+      for (s = prof_samples[b]; s != NULL; s = next){
+	 next = s->next;
+	 s->next = prof_spare;
+	 prof_spare = s;
+      }
+      prof_samples[b] = NULL;
+   }
+   for (int x = 0; x < PROF_STACKS; x++){
+      for (st = prof_stacks[x]; st != NULL; st = st->next){
+	 st->live_bytes = 0;
+	 st->live_count = 0;
+      }
+   }
+   prof_live = 0;
+   pthread_mutex_unlock(&prof_lock);
+}
+
+/*
+ * mm_profile_dump - Writes the profile to fd. MM_PROFILE_PPROF writes the
+ * live and total tallies of every stack in the text heap profile format
+ * that pprof reads, with the process's mappings appended for symbolization.
+ * MM_PROFILE_LIVE and MM_PROFILE_TOTAL write one line of folded stacks per
+ * stack, outermost frame first, for flamegraph.pl. Frames are named with
+ * dladdr, so a program has to be linked with -rdynamic for its own symbols
+ * to show. Returns 0, or -1 if a write failed.
+ */
+int mm_profile_dump(int fd, int format){
+   struct dump_out o;
+   struct prof_stack *st;
+   unsigned long count = 0, total_count = 0;
+   size_t bytes = 0, total_bytes = 0;
+   ssize_t n;
+   int maps;
+
+   o.fd = fd;
+   o.err = 0;
+   o.len = 0;
+   prof_busy++;
+   pthread_mutex_lock(&prof_lock);
+   for (int x = 0; x < PROF_STACKS; x++){
+      for (st = prof_stacks[x]; st != NULL; st = st->next){
+	 count += st->live_count;
+	 bytes += st->live_bytes;
+	 total_count += st->total_count;
+	 total_bytes += st->total_bytes;
+      }
+   }
+   if (format == MM_PROFILE_PPROF){
+      dump_put(&o, "heap profile: %6lu: %8zu [%6lu: %8zu] @ heapprofile\n",\
+	    count, bytes, total_count, total_bytes);
+   }
+   for (int x = 0; x < PROF_STACKS; x++){
+      for (st = prof_stacks[x]; st != NULL; st = st->next){
+	 if (format == MM_PROFILE_PPROF){
+	    dump_put(&o, "%6lu: %8zu [%6lu: %8zu] @", st->live_count,\
+		  st->live_bytes, st->total_count, st->total_bytes);
+	    for (int y = 0; y < st->depth; y++){
+	       dump_put(&o, " %p", st->pc[y]);
+	    }
+	    dump_put(&o, "\n");
+	    continue;
+	 }
+	 bytes = (format == MM_PROFILE_LIVE) ? st->live_bytes : st->total_bytes;
+	 if (bytes == 0){
+	    continue;
+	 }
+	 for (int y = st->depth - 1; y >= 0; y--){
+	    prof_frame(&o, st->pc[y]);
+	    dump_put(&o, y ? ";" : " %zu\n", bytes);
+	 }
+      }
+   }
+   pthread_mutex_unlock(&prof_lock);
+
+   if (format == MM_PROFILE_PPROF){
+      dump_put(&o, "\nMAPPED_LIBRARIES:\n");
+      if ((maps = open("/proc/self/maps", O_RDONLY)) >= 0){
+	 while ((n = read(maps, o.buf + o.len, sizeof(o.buf) - o.len)) > 0){
+	    if ((o.len += n) == sizeof(o.buf)){
+	       dump_flush(&o);
+	    }
+	 }
+	 close(maps);
+      }
+   }
+   dump_flush(&o);
+   prof_busy--;
+   return o.err ? -1 : 0;
+}
+
+/*
+ * dump_put - Formats into the buffer of o, writing the buffer out first if
+ * the text does not fit. Text longer than the buffer is cut short.
+ */
+static void dump_put(struct dump_out *o, const char *fmt, ...){
+   va_list ap;
+   int n;
+
+   for (int tries = 0; tries < 2; tries++){
+      va_start(ap, fmt);
+      n = vsnprintf(o->buf + o->len, sizeof(o->buf) - o->len, fmt, ap);
+      va_end(ap);
+      if (n >= 0 && (size_t)n < sizeof(o->buf) - o->len){
+	 o->len += n;
+	 return;
+      }
+      dump_flush(o);
+   }
+   o->len = sizeof(o->buf) - 1;
+}
+
+/*
+ * dump_flush - Writes out the buffer of o, setting its err if that fails.
+ */
+static void dump_flush(struct dump_out *o){
+   char *p = o->buf;
+   ssize_t n;
+
+   while (!o->err && o->len > 0){
+      if ((n = write(o->fd, p, o->len)) <= 0){
+	 o->err = 1;
+	 break;
+      }
+      p += n;
+      o->len -= n;
+   }
+   o->len = 0;
+}
+
+/*
+ * dump_write - Appends n bytes at p to the buffer of o.
+ */
+static void dump_write(struct dump_out *o, const void *p, size_t n){
+   size_t k;
+
+   while (n > 0){
+      if (o->len == sizeof(o->buf)){
+	 dump_flush(o);
+      }
+      k = MIN(n, sizeof(o->buf) - o->len);
+      memcpy(o->buf + o->len, p, k);
+      o->len += k;
+      p = (const char *)p + k;
+      n -= k;
+   }
+}
+
+/*
+ * prof_frame - Names the function holding return address pc for a folded
+ * stack: its symbol, else its object file and offset, else the address.
+ */
+static void prof_frame(struct dump_out *o, void *pc){
+   Dl_info info;
+   const char *file;
+
+   if (dladdr((char *)pc - 1, &info) == 0 || info.dli_fname == NULL){
+      dump_put(o, "%p", pc);
+   }
+   else if (info.dli_sname != NULL){
+      dump_put(o, "%s", info.dli_sname);
+   }
    else {
-      remove_from_list(PREV_BLK(bp));
-      remove_from_list(NEXT_BLK(bp));
-      size += GET_SIZE(HDR(PREV_BLK(bp))) +\
-	      GET_SIZE(FTR(NEXT_BLK(bp)));
-      PUT_INT(HDR(PREV_BLK(bp)), PACK(size, 0));
-      PUT_INT(FTR(NEXT_BLK(bp)), PACK(size, 0));
-      lifo_insert(PREV_BLK(bp));
-      return (PREV_BLK(bp));
+      file = strrchr(info.dli_fname, '/');
+      dump_put(o, "%s+%#lx", file ? file + 1 : info.dli_fname,\
+	    (unsigned long)((char *)pc - (char *)info.dli_fbase));
    }
 }
+
 /*
- * realloc - Reallocate existing block and data to a new block
+ * mm_dump_layout - Writes the heap layout to fd: the header, a record for each
+ * block of the implicit list past the prologue, and a record for each block in
+ * the fast bins and in the calling thread's cache. The inbox is drained first,
+ * so blocks freed by other threads show as free. Returns 0, or -1 if a write
+ * failed.
  */
-void *realloc(void *oldptr, size_t size) {
-   unsigned oldsize, asize;
+int mm_dump_layout(int fd){
+   struct thread_cache *tc;
+   struct mm_layout_header hdr;
+   struct dump_out o;
+   struct slab *s;
    char *bp;
-   size_t buff[1];
-   size_t* buffer = buff; 
 
-   /* Adjust block size */
-   if (size <= WSIZE)
-      asize = WSIZE + WSIZE;
-   else
-      asize = ALIGN(size + WSIZE);
+   if (!HEAP_READY())
+      return -1;
+   tc = tcache_get();
+   o.fd = fd;
+   o.err = 0;
+   o.len = 0;
+   memset(&hdr, 0, sizeof(hdr));
+   hdr.magic = MM_LAYOUT_MAGIC;
+   hdr.nbins = NO_LISTS;
+#ifdef TLSF
+   hdr.tlsf = 1;
+#endif
+   hdr.mapped_bytes = __atomic_load_n(&stats.mapped_bytes, __ATOMIC_RELAXED);
+
+   HEAP_LOCK();
+   hdr.heap_size = mem_heapsize();
+   dump_write(&o, &hdr, sizeof(hdr));
+   for (bp = NEXT_BLK(heap); GET_SIZE(HDR(bp)) > 0; bp = NEXT_BLK(bp)){
+      if (!GET_ALLOC(HDR(bp)))
+	 layout_rec(&o, bp, MM_LAYOUT_FREE);
+      else if ((s = slab_lookup(bp)) != NULL && (char *)s == bp)
+	 layout_rec(&o, bp, MM_LAYOUT_SLAB);
+      else
+	 layout_rec(&o, bp, MM_LAYOUT_ALLOC);
+   }
+   for (int x = 0; x < NO_FAST; x++){
+      for (bp = fast_bins[x]; bp != NULL; bp = CACHE_NEXT(bp)){
+	 layout_rec(&o, bp, MM_LAYOUT_FAST);
+      }
+   }
+   for (int cls = 0; cls < NO_CACHES; cls++){
+      for (bp = tc->list[cls]; bp != NULL; bp = CACHE_NEXT(bp)){
+	 if (slab_lookup(bp) == NULL)
+	    layout_rec(&o, bp, MM_LAYOUT_CACHED);
+      }
+   }
+   dump_flush(&o);
+   HEAP_UNLOCK();
+   return o.err ? -1 : 0;
+}
 
-   /* If size == 0 then this is just free, and we return NULL. */
-   if(size == 0) {
-      free(oldptr);
-      return NULL;
+/*
+ * layout_rec - Appends the layout record of block bp, of the given kind.
+ * Caller must hold the heap lock.
+ */
+static void layout_rec(struct dump_out *o, char *bp, unsigned kind){
+   struct mm_layout_rec rec;
+   struct slab *s;
+
+   rec.offset = bp - heap;
+   rec.size = GET_SIZE(HDR(bp));
+   rec.spare = 0;
+   if (kind == MM_LAYOUT_SLAB){
+      s = (struct slab *)bp;
+      rec.spare = s->nfree * s->size;
    }
+   rec.bin = find_size_bin(rec.size);
+   rec.kind = kind;
+   dump_write(o, &rec, sizeof(rec));
+}
 
-   /* If oldptr is NULL, then this is just malloc. */
-   if(oldptr == NULL) {
-      return malloc(size);
+/*
+ * cmp_ptr - Orders pointers by address for qsort.
+ */
+static int cmp_ptr(const void *a, const void *b){
+   size_t x = (size_t)*(void * const *)a, y = (size_t)*(void * const *)b;
+   return (x > y) - (x < y);
+}
+
+/*
+ * tcache_get - Returns the calling thread's cache. A cache left over from a
+ * previous mm_init is emptied without touching the heap it was filled from.
+ * The first call in each thread registers the cache for flushing on exit.
+ */
+static struct thread_cache *tcache_get(void){
+   struct thread_cache *tc = &tcache;
+   if (tc->epoch != heap_epoch){
+      if (tc->epoch == 0){
+         pthread_once(&tcache_once, tcache_init_key);
+         pthread_setspecific(tcache_key, tc);
+      }
+      memset(tc->list, 0, sizeof(tc->list));
+      memset(tc->count, 0, sizeof(tc->count));
+      tc->allocs = 0;
+      tc->frees = 0;
+      tc->epoch = heap_epoch;
    }
+   return tc;
+}
 
-   /* Save data that will be written over by free-list pointers */
-   memcpy(buffer, oldptr, WSIZE); 
-   
-   /* Unallocate previous block and search for fit as with malloc */
-   oldsize = GET_SIZE(HDR(oldptr));
-   free(oldptr);
+/*
+ * tcache_refill - Carves up to CACHE_BATCH blocks for payload class cls out
+ * of the shared heap with a single acquisition of the heap lock.
+ */
+static void tcache_refill(struct thread_cache *tc, int cls){
+   char *bp;
+   HEAP_LOCK();
+   tcache_fold(tc);
+   for (int x = 0; x < CACHE_BATCH; x++){
+      if ((bp = heap_malloc(cls * ALIGNMENT)) == NULL){
+         break;
+      }
+      CACHE_NEXT(bp) = tc->list[cls];
+      tc->list[cls] = bp;
+      tc->count[cls]++;
+   }
+   HEAP_UNLOCK();
+}
 
-   if((bp = find_fit(asize)) == NULL){
-      size_t extendsize = MAX(asize, PAGESIZE);
-      if ((bp = grow_heap(extendsize/WSIZE)) == NULL){
-	 return NULL;
+/*
+ * tcache_flush - Returns all but keep blocks of payload class cls to the
+ * shared heap, where they are coalesced as usual. If the heap lock is
+ * taken they are pushed onto the heap's inbox as a single chain instead.
+ */
+static void tcache_flush(struct thread_cache *tc, int cls, unsigned keep){
+   char *bp, *last;
+   unsigned n;
+
+   if (tc->count[cls] <= keep){
+      return;
+   }
+   if (pthread_mutex_trylock(&heap_lock) != 0){
+      n = tc->count[cls] - keep;
+      bp = last = tc->list[cls];
+      for (unsigned x = 1; x < n; x++){
+	 last = CACHE_NEXT(last);
       }
+      tc->list[cls] = CACHE_NEXT(last);
+      tc->count[cls] = keep;
+      remote_push(bp, last, n);
+      return;
    }
-   
-   /* Copy previous contents to new block */
-   if(asize < oldsize){ 
-      oldsize = asize;
+   remote_drain();
+   tcache_fold(tc);
+   while (tc->count[cls] > keep){
+      bp = tc->list[cls];
+      tc->list[cls] = CACHE_NEXT(bp);
+      tc->count[cls]--;
+      heap_free(bp);
    }
+   HEAP_UNLOCK();
+}
 
-   oldsize = oldsize - WSIZE;
-   memcpy((char *)bp + WSIZE, (char *)oldptr + WSIZE, oldsize - WSIZE);
-   place(bp, asize);
-   memcpy((char *)bp, (char *)buffer, WSIZE);
-   return bp;
+/*
+ * remote_push - Pushes the chain of n blocks from first to last, linked
+ * like a thread cache list, onto the heap's inbox. Takes no lock.
+ */
+static void remote_push(char *first, char *last, unsigned long n){
+   char *head = __atomic_load_n(&remote_inbox, __ATOMIC_RELAXED);
+   do {
+      CACHE_NEXT(last) = head;
+   } while (!__atomic_compare_exchange_n(&remote_inbox, &head, first, 1,\
+	    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+   __atomic_add_fetch(&stats.remote_frees, n, __ATOMIC_RELAXED);
+}
+
+/*
+ * remote_drain - Frees every block in the heap's inbox. Caller must hold
+ * the heap lock, which makes it the only thread popping the inbox.
+ */
+static void remote_drain(void){
+   char *bp, *next;
+
+   if (__atomic_load_n(&remote_inbox, __ATOMIC_RELAXED) == NULL){
+      return;
+   }
+   bp = __atomic_exchange_n(&remote_inbox, NULL, __ATOMIC_ACQUIRE);
+   for (; bp != NULL; bp = next){
+      next = CACHE_NEXT(bp);
+      heap_free(bp);
+   }
+}
 
+/*
+ * tcache_fold - Adds the hits counted by cache tc to stats. Caller must hold
+ * the heap lock.
+ */
+static void tcache_fold(struct thread_cache *tc){
+   stats.cache_allocs += tc->allocs;
+   stats.cache_frees += tc->frees;
+   tc->allocs = 0;
+   tc->frees = 0;
 }
 
 /*
- * calloc - Allocates a block, intialized to zero
+ * tcache_init_key - Creates the key whose destructor flushes a thread's
+ * cache when the thread exits.
  */
-void *calloc (size_t nmemb, size_t size) {
-   void *bp;
-   if ((bp = malloc(nmemb*size)) != NULL){
-      for(unsigned i = 0; i < nmemb*size; i += 4){
-	 PUT_INT((bp+i), 0);
-      }
+static void tcache_init_key(void){
+   pthread_key_create(&tcache_key, tcache_exit);
+}
+
+/*
+ * tcache_exit - Thread exit destructor, hands every cached block back to the
+ * shared heap unless the heap has been reinitialized since.
+ */
+static void tcache_exit(void *arg){
+   struct thread_cache *tc = arg;
+   if (tc->epoch != heap_epoch){
+      return;
+   }
+   for (int cls = 0; cls < NO_CACHES; cls++){
+      tcache_flush(tc, cls, 0);
+   }
+}
+
+/*
+ * slab_lookup - Returns the slab holding object bp, or NULL if bp is an
+ * ordinary block. Pointers outside the mapped range are never slab objects.
+ */
+static struct slab *slab_lookup(const void *bp){
+   size_t page = PAGE_NO(bp);
+   unsigned char *leaf;
+   if ((page >> MAP_LEAF_SHIFT) >= MAP_TOP)
+      return NULL;
+   if ((leaf = page_map[page >> MAP_LEAF_SHIFT]) == NULL)
+      return NULL;
+   if (leaf[page & (MAP_LEAF - 1)] == 0)
+      return NULL;
+   return SLAB_OF(bp);
+}
+
+/*
+ * page_map_set - Marks the page of slab p in the page map, allocating the
+ * leaf if needed. Returns -1 if the leaf could not be allocated.
+ */
+static int page_map_set(void *p, unsigned char val){
+   size_t page = PAGE_NO(p);
+   unsigned char **leaf;
+   if ((page >> MAP_LEAF_SHIFT) >= MAP_TOP)
+      return -1;
+   leaf = &page_map[page >> MAP_LEAF_SHIFT];
+   if (*leaf == NULL){
+      if ((*leaf = heap_malloc(MAP_LEAF)) == NULL)
+         return -1;
+      memset(*leaf, 0, MAP_LEAF);
+   }
+   (*leaf)[page & (MAP_LEAF - 1)] = val;
+   return 0;
+}
+
+/*
+ * slab_alloc - Takes the lowest free object out of the first slab of the
+ * class for size, creating a new slab if the class has none with room.
+ * Caller must hold the heap lock.
+ */
+static void *slab_alloc(size_t size){
+   int cls = CACHE_CLASS(size);
+   struct slab *s;
+   int w, bit;
+
+   if (cls == 0)
+      cls = 1;
+   if ((s = slabs[cls]) == NULL && (s = slab_new(cls)) == NULL)
+      return NULL;
+
+   for (w = 0; s->map[w] == 0; w++)
+      ;
+   bit = __builtin_ctzl(s->map[w]);
+   s->map[w] &= ~(1UL << bit);
+   stats.slab_allocs++;
+
+   /* A full slab leaves the class list until an object is freed */
+   if (--s->nfree == 0){
+      slabs[cls] = s->next;
+      if (s->next)
+         s->next->prev = NULL;
+   }
+   return (char *)s + s->first + (size_t)(w * 64 + bit) * s->size;
+}
+
+/*
+ * slab_free - Marks object bp free in its slab. A slab that becomes empty is
+ * handed back to the heap unless it is the only one left in its class.
+ * Caller must hold the heap lock.
+ */
+static void slab_free(struct slab *s, void *bp){
+   int cls = s->size / ALIGNMENT;
+   unsigned idx = ((char *)bp - ((char *)s + s->first)) / s->size;
+
+   s->map[idx / 64] |= 1UL << (idx % 64);
+   stats.slab_frees++;
+
+   /* Slab had been full, make it available again */
+   if (s->nfree++ == 0){
+      s->prev = NULL;
+      s->next = slabs[cls];
+      if (s->next)
+         s->next->prev = s;
+      slabs[cls] = s;
+   }
+
+   if (s->nfree == s->nobjs && (s->prev || s->next)){
+      if (s->prev)
+         s->prev->next = s->next;
+      else
+         slabs[cls] = s->next;
+      if (s->next)
+         s->next->prev = s->prev;
+      page_map_set(s, 0);
+      heap_free(s);
    }
-   return NULL;
 }
 
+/*
+ * slab_new - Allocates a SLAB_SIZE aligned run from the heap and sets it up
+ * as an empty slab for class cls. Caller must hold the heap lock.
+ */
+static struct slab *slab_new(int cls){
+   struct slab *s;
+   unsigned x;
+
+   if ((s = heap_memalign(SLAB_SIZE, SLAB_SIZE)) == NULL)
+      return NULL;
+   if (page_map_set(s, 1) < 0){
+      heap_free(s);
+      return NULL;
+   }
+
+   s->size = cls * ALIGNMENT;
+   s->first = ALIGN(sizeof(struct slab));
+   s->nobjs = (SLAB_SIZE - s->first) / s->size;
+   s->nfree = s->nobjs;
+   memset(s->map, 0, sizeof(s->map));
+   for (x = 0; x < s->nobjs; x++)
+      s->map[x / 64] |= 1UL << (x % 64);
+
+   s->prev = NULL;
+   s->next = slabs[cls];
+   if (s->next)
+      s->next->prev = s;
+   slabs[cls] = s;
+   return s;
+}
 
 /*
  * in_heap - Return whether the pointer is in the heap.
@@ -596,10 +3621,16 @@ void mm_checkheap(int lineno) {
    /* Check prologue and epilogue blocks*/
    check_pro_epi(lineno);
 
+   /* Check the heap can still be addressed by free list offsets */
+   if ((size_t)mem_heap_hi() + 1 - INDEX > MAX_SPAN){
+      printf("ERROR Heap of %zu bytes exceeds span limit (at line %d)\n",\
+	    (size_t)mem_heap_hi() + 1 - INDEX, lineno);
+      exit(1);
+   }
+
    /* Check allocated blocks in implicit list*/
    for (bp = heap; GET_SIZE(HDR(bp)) > 0; bp = NEXT_BLK(bp)){
-      point_check(HDR(bp), "Header of allocated block", lineno);
-      point_check((char *)FTR(bp) - 4, "Footer of allocated block", lineno);
+      point_check((char *)HDR(bp) - 4, "Header of allocated block", lineno);
       check_head_foot(bp, lineno);
       check_coalesce(bp, lineno);
       point_check(bp, "Allocated block", lineno);
@@ -608,15 +3639,30 @@ void mm_checkheap(int lineno) {
    /* Check free blocks in all free lists*/
    for (int x = 0; x < NO_LISTS; x++){
       free_list = (char *)(FULL_HEAP+ (x*WSIZE));
+#ifdef TLSF
+      int fl = x / SL_COUNT, sl = x % SL_COUNT;
+      if ((GET(free_list) != 0) != ((sl_bitmap[fl] >> sl) & 1) ||\
+	    (sl_bitmap[fl] != 0) != ((fl_bitmap >> fl) & 1)){
+	 printf("ERROR Free list %d does not match TLSF bitmaps "\
+	       "(at line %d)\n", x, lineno);
+	 exit(1);
+      }
+#endif
+#ifndef TLSF
+      if (x == NO_LISTS-1){
+	 check_tree((char *)GET(free_list), NULL, NULL, lineno);
+	 continue;
+      }
+#endif
       if((bp = (char *)GET(free_list)) != NULL){
 	 point_check(bp, "List start pointer for list ", lineno);
 	 count = 0;
 	 do{
 	    count = count +1;
 	    point_check(bp, "Free block", lineno);
-	    point_check(HDR(bp), "Header for Free block", lineno);
-	    /* Since the footer is an int which starts at the 4th byte */
-	    point_check((char *)FTR(bp) - 4, "Footer for Free block", lineno);
+	    /* Since the header is an int which starts at the 4th byte */
+	    point_check((char *)HDR(bp) - 4, "Header for Free block", lineno);
+	    point_check(FTR(bp), "Footer for Free block", lineno);
 
 	    check_head_foot(bp, lineno);            
 	    check_coalesce(bp, lineno);
@@ -625,6 +3671,38 @@ void mm_checkheap(int lineno) {
 	 } while (bp != (size_t)0);
       }
    }
+
+   /* Check blocks waiting in the fast bins */
+   for (int x = 0; x < NO_FAST; x++){
+      for (bp = fast_bins[x]; bp != NULL; bp = CACHE_NEXT(bp)){
+	 point_check(bp, "Fast bin block", lineno);
+	 if (GET_SIZE(HDR(bp)) != (unsigned)x * ALIGNMENT ||\
+	       !GET_ALLOC(HDR(bp))){
+	    printf("ERROR Fast bin block %p of size %u in bin %d "\
+		  "(at line %d)\n", bp, GET_SIZE(HDR(bp)), x, lineno);
+	    exit(1);
+	 }
+      }
+   }
+
+   /* Check blocks waiting in the inbox, more may be pushed meanwhile */
+   for (bp = __atomic_load_n(&remote_inbox, __ATOMIC_ACQUIRE); bp != NULL;\
+	 bp = CACHE_NEXT(bp)){
+      point_check(bp, "Inbox block", lineno);
+      if (slab_lookup(bp) == NULL &&\
+	    (!GET_ALLOC(HDR(bp)) || GET_MMAPPED(HDR(bp)))){
+	 printf("ERROR Inbox block %p is not an allocated heap block \
+	       (at line %d)\n", bp, lineno);
+	 exit(1);
+      }
+   }
+
+   /* Check slabs with free objects in every slab class */
+   for (int x = 1; x < NO_SLABS; x++){
+      for (struct slab *s = slabs[x]; s != NULL; s = s->next){
+	 check_slab(s, x, lineno);
+      }
+   }
 }
 
 /*
@@ -669,7 +3747,7 @@ void check_pro_epi(int lineno){
 	 test = 0;
       }
 
-      if (THIS(locate) == NULL){
+      if (locate == NULL){
 	 printf(" WARNING!! %s not assigned yet (at line %d)\n", type, lineno);
 	 break;
       }
@@ -686,25 +3764,38 @@ void check_pro_epi(int lineno){
 }
 /*
  * check_head_foot - Checks whether size and allocation of header and footer 
- * match. Checks whether block is greater than minimum size.
+ * match for free blocks, and whether the next block's prev alloc bit matches
+ * the allocation of this one. Checks whether block is greater than minimum
+ * size.
  */
 void check_head_foot(void *bp, int lineno){
-   int var1,var2;
-   if ((var1 = GET_SIZE(HDR(bp))) != (var2 = GET_SIZE(FTR(bp)))){
-      printf("ERROR Header-Footer size mismatch in allocated block %p - \
-	    %d vs  %d, (at line %d) \n", bp, var1, var2, lineno);
+   unsigned var1,var2;
+   if (!GET_ALLOC(HDR(bp)) != !GET_PREV_ALLOC(HDR(NEXT_BLK(bp)))){
+      printf("ERROR Prev alloc bit of block %p does not match block %p \
+	    (at line %d) \n", NEXT_BLK(bp), bp, lineno);
       exit(1);
    }
 
-   if ((var1 < MIN_SIZE) && (bp != (heap))){
-      printf("ERROR Block %p smaller of size %d than minimum size \
+   if ((var1 = GET_SIZE(HDR(bp))) < MIN_SIZE && (bp != (heap))){
+      printf("ERROR Block %p smaller of size %u than minimum size \
 	    (at line %d)\n", bp, var1, lineno);
       exit(1);
    }
 
+   /* Allocated blocks have no footer */
+   if (GET_ALLOC(HDR(bp))){
+      return;
+   }
+
+   if ((var1 = GET_SIZE(HDR(bp))) != (var2 = GET_SIZE(FTR(bp)))){
+      printf("ERROR Header-Footer size mismatch in allocated block %p - \
+	    %u vs  %u, (at line %d) \n", bp, var1, var2, lineno);
+      exit(1);
+   }
+
    if ((var1 = GET_ALLOC(HDR(bp))) != (var2 = GET_ALLOC(FTR(bp)))){ 
       printf("ERROR Header-Footer allocation mismatch in allocated\
-	    blocks- %d vs  %d, (at line %d) \n", var1, var2, lineno);
+	    blocks- %u vs  %u, (at line %d) \n", var1, var2, lineno);
       exit(1);
    }
 }
@@ -733,6 +3824,11 @@ void check_match_bin(void *bp, int lineno, int count, int x){
    if ((size_t)NEXTP(GET(bp)) != 0){
       point_check(NEXTP(GET(bp)),"Next pointer ",lineno);
       point_check(NEXTP(GET(bp)),"Prev pointer ",lineno);
+      if (order_policy == MM_ORDER_ADDRESS && NEXTP(GET(bp)) < (char *)bp){
+	 printf("ERROR Free list %d - block %d (%p) out of address order \
+	       (at line %d) \n", x, count, bp, lineno);
+	 exit(1);
+      }
       if ((char *)(PREVP(GET(NEXTP(GET(bp))))) != (char *)(bp)){
 	 printf("ERROR Free list %d - consecutive pointers mismatch at \
 	       block %d (%p) (at line %d) \n", x, count, bp, lineno);
@@ -748,6 +3844,70 @@ void check_match_bin(void *bp, int lineno, int count, int x){
    }
 }
 
+#ifndef TLSF
+/*
+ * check_tree - Checks every node of the treap rooted at bp like a free list
+ * member, and checks that its key lies between those of lo and hi (either
+ * may be NULL) and that no child has a higher priority. Returns the number
+ * of nodes.
+ */
+int check_tree(char *bp, char *lo, char *hi, int lineno){
+   if (bp == NULL){
+      return 0;
+   }
+   point_check(bp, "Tree node", lineno);
+   point_check((char *)HDR(bp) - 4, "Header for Tree node", lineno);
+   point_check(FTR(bp), "Footer for Tree node", lineno);
+   check_head_foot(bp, lineno);
+   check_coalesce(bp, lineno);
+   if (find_size_bin(GET_SIZE(HDR(bp))) != NO_LISTS-1){
+      printf("ERROR Tree node %p of size %d in wrong size bin (at line %d)\n",\
+	    bp, GET_SIZE(HDR(bp)), lineno);
+      exit(1);
+   }
+   if ((lo != NULL && !TREE_LESS(lo, bp)) ||\
+	 (hi != NULL && !TREE_LESS(bp, hi))){
+      printf("ERROR Tree node %p out of order (at line %d)\n", bp, lineno);
+      exit(1);
+   }
+   if ((LEFT(bp) && PRIO(LEFT(bp)) > PRIO(bp)) ||\
+	 (RIGHT(bp) && PRIO(RIGHT(bp)) > PRIO(bp))){
+      printf("ERROR Tree node %p has a child of higher priority "\
+	    "(at line %d)\n", bp, lineno);
+      exit(1);
+   }
+   return 1 + check_tree(LEFT(bp), lo, bp, lineno) +\
+      check_tree(RIGHT(bp), bp, hi, lineno);
+}
+#endif
+
+/*
+ * check_slab - Checks whether slab s is aligned, marked in the page map,
+ * belongs to class x and whether its free count matches its bitmap.
+ */
+void check_slab(struct slab *s, int x, int lineno){
+   unsigned count = 0;
+   point_check(s, "Slab", lineno);
+   if (SLAB_OF(s) != s || slab_lookup(s) != s){
+      printf("ERROR Slab %p not aligned or not in page map (at line %d)\n",\
+	    (void *)s, lineno);
+      exit(1);
+   }
+   if (s->size != (unsigned)x * ALIGNMENT || s->nfree == 0){
+      printf("ERROR Slab %p of size %d with %d free in class %d \
+	    (at line %d)\n", (void *)s, s->size, s->nfree, x, lineno);
+      exit(1);
+   }
+   for (int w = 0; w < SLAB_WORDS; w++){
+      count += __builtin_popcountl(s->map[w]);
+   }
+   if (count != s->nfree){
+      printf("ERROR Slab %p bitmap has %d free objects, count is %d \
+	    (at line %d)\n", (void *)s, count, s->nfree, lineno);
+      exit(1);
+   }
+}
+
 /*
  * check_coalesce - Checks whether all adjacent free blocks have been coalesced
  * WARNING! This function's behaviour is undefined for calls from:
@@ -756,9 +3916,18 @@ void check_match_bin(void *bp, int lineno, int count, int x){
  */
 void check_coalesce(void *bp, int lineno){
    /* Get allocated bit for previous, next and current blocks */
-   size_t prev_alloc = GET_ALLOC(FTR(PREV_BLK(bp)));
+   size_t prev_alloc = GET_PREV_ALLOC(HDR(bp)) ? 1 : 0;
    size_t next_alloc = GET_ALLOC(HDR(NEXT_BLK(bp)));
    size_t alloc = GET_ALLOC(HDR(bp));
+   size_t size = GET_SIZE(HDR(bp));
+
+   /* Blocks that together exceed MAX_BLOCK are never coalesced */
+   if (!prev_alloc && size + GET_SIZE(HDR(PREV_BLK(bp))) > MAX_BLOCK){
+      prev_alloc = 1;
+   }
+   if (size + GET_SIZE(HDR(NEXT_BLK(bp))) > MAX_BLOCK){
+      next_alloc = 1;
+   }
 
    /* Only check free blocks */ 
    if(alloc == 0){
@@ -777,3 +3946,87 @@ void check_coalesce(void *bp, int lineno){
       }
    }
 }
+
+#ifdef HEAP_CHECK
+/*
+ * dirty_drop - Removes block bp, which has just been merged into another
+ * block, from the dirty set.
+ */
+static void dirty_drop(char *bp){
+   for (unsigned x = 0; x < MIN(ndirty, DIRTY_MAX); x++){
+      if (dirty[x] == bp){
+	 dirty[x] = NULL;
+      }
+   }
+}
+
+/*
+ * heap_check_point - Checks the heap as check_mode asks before the heap
+ * lock is released, on a random one in check_one_in calls, and empties the
+ * dirty set. An overflowed dirty set gets a full check.
+ */
+static void heap_check_point(int lineno){
+   if (check_mode != MM_CHECK_OFF && check_one_in > 1){
+      check_seed ^= check_seed << 13;
+      check_seed ^= check_seed >> 7;
+      check_seed ^= check_seed << 17;
+   }
+   if (check_mode == MM_CHECK_OFF || check_seed % check_one_in != 0){
+      ndirty = 0;
+      return;
+   }
+   if (check_mode == MM_CHECK_FULL || ndirty > DIRTY_MAX){
+      mm_checkheap(lineno);
+   }
+   else {
+      check_pro_epi(lineno);
+      for (unsigned x = 0; x < ndirty; x++){
+	 if (dirty[x] != NULL){
+	    check_block(dirty[x], lineno);
+	 }
+      }
+   }
+   ndirty = 0;
+}
+
+/*
+ * check_block - Checks a single block like mm_checkheap does in its walk of
+ * the heap. A free block must also be linked into the list of its bin, or
+ * be found in the treap, without walking the rest of the list.
+ */
+void check_block(void *bp, int lineno){
+   int x = find_size_bin(GET_SIZE(HDR(bp)));
+   char *free_list = (char *)(FULL_HEAP + (x * WSIZE));
+   char *prev, *next;
+
+   point_check(bp, "Dirty block", lineno);
+   point_check((char *)HDR(bp) - 4, "Header of dirty block", lineno);
+   check_head_foot(bp, lineno);
+   check_coalesce(bp, lineno);
+   if (GET_ALLOC(HDR(bp))){
+      return;
+   }
+   point_check(FTR(bp), "Footer of dirty block", lineno);
+
+#ifndef TLSF
+   if (x == NO_LISTS-1){
+      for (next = (char *)GET(free_list); next != NULL && next != bp;\
+	    next = TREE_LESS(bp, next) ? LEFT(next) : RIGHT(next));
+      if (next == NULL){
+	 printf("ERROR Free block %p not in tree (at line %d)\n", bp, lineno);
+	 exit(1);
+      }
+      return;
+   }
+#endif
+   prev = PREVP(GET(bp));
+   next = NEXTP(GET(bp));
+   if ((prev == NULL && (char *)GET(free_list) != bp) ||\
+	 (prev != NULL && NEXTP(GET(prev)) != bp) ||\
+	 (next != NULL && PREVP(GET(next)) != bp)){
+      printf("ERROR Free block %p not linked into list %d (at line %d)\n",\
+	    bp, x, lineno);
+      exit(1);
+   }
+}
+#endif
@@ -0,0 +1,278 @@
+/*
+ * mm_bench.c
+ *
+ * Latency benchmark for mm.c. Runs a seeded random mix of malloc, free and
+ * realloc calls over a fixed number of live slots and reports throughput,
+ * peak heap utilization and latency percentiles for each operation. Sizes
+ * are drawn log-uniformly from 16 bytes to 256KB so that both the small
+ * bins and the long lists of the largest bin get exercised.
+ *
+ * The benchmark links against mm.c and the memlib.c simulator. Build it once
+ * for each free list mode and compare the two runs:
+ *
+ *   gcc -O2 -DDRIVER -o bench_bins mm_bench.c mm.c memlib.c -lpthread
+ *   gcc -O2 -DDRIVER -DTLSF -o bench_tlsf mm_bench.c mm.c memlib.c -lpthread
+ *
+ * Usage: bench_bins [-n ops] [-l live slots] [-s seed] [-f fit] [-o order]
+ *        bench_bins -A [-n ops] [-l live slots] [-s seed]
+ *
+ * -f picks the placement policy (first, next, best or good) and -o the free
+ * list order (lifo or address), see mm_set_policy. -A runs the workload once
+ * for every combination and prints the throughput, utilization and search
+ * length of each on a line of its own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "mm.h"
+#include "mm_ext.h"
+#include "memlib.h"
+
+#ifdef TLSF
+#define MODE "tlsf"
+#else
+#define MODE "bins"
+#endif
+
+/* Operation kinds, latencies are kept per kind */
+#define OP_MALLOC 0
+#define OP_FREE 1
+#define OP_REALLOC 2
+#define NO_OPS 3
+
+static const char *op_names[NO_OPS] = {"malloc", "free", "realloc"};
+
+/* Policy names, indexed by the MM_FIT_ and MM_ORDER_ constants */
+static const char *fit_names[] = {"first", "next", "best", "good"};
+static const char *order_names[] = {"lifo", "address"};
+#define NO_FITS 4
+#define NO_ORDERS 2
+
+/* Outcome of one run of the workload */
+struct result {
+   long elapsed;
+   size_t peak_bytes;
+   size_t heap_size;
+};
+
+/* Function prototypes */
+static void run(long ops, long live, unsigned seed, long **lat, long *count,
+      struct result *res);
+static int lookup(const char *name, const char **names, int n);
+static void usage(const char *prog);
+static size_t rand_size(void);
+static long now_ns(void);
+static int cmp_long(const void *a, const void *b);
+static void report(const char *name, long *lat, long n);
+
+/*
+ * main - Parses options, runs the workload and prints the report.
+ */
+int main(int argc, char **argv)
+{
+   long ops = 1000000, live = 4096;
+   unsigned seed = 1;
+   int c, fit = MM_FIT_FIRST, order = MM_ORDER_LIFO, all = 0;
+
+   while ((c = getopt(argc, argv, "n:l:s:f:o:A")) != -1){
+      switch (c){
+      case 'n': ops = atol(optarg); break;
+      case 'l': live = atol(optarg); break;
+      case 's': seed = atoi(optarg); break;
+      case 'f':
+         if ((fit = lookup(optarg, fit_names, NO_FITS)) < 0)
+            usage(argv[0]);
+         break;
+      case 'o':
+         if ((order = lookup(optarg, order_names, NO_ORDERS)) < 0)
+            usage(argv[0]);
+         break;
+      case 'A': all = 1; break;
+      default: usage(argv[0]);
+      }
+   }
+
+   long *lat[NO_OPS], count[NO_OPS];
+   for (int x = 0; x < NO_OPS; x++){
+      if ((lat[x] = malloc(ops * sizeof(long))) == NULL){
+         fprintf(stderr, "out of memory\n");
+         exit(1);
+      }
+   }
+   mem_init();
+
+   struct result res;
+   struct mm_stats st;
+   if (all){
+      printf("%-14s %12s %12s %14s\n", "policy", "ops/s", "utilization",
+            "steps/search");
+      for (fit = 0; fit < NO_FITS; fit++){
+         for (order = 0; order < NO_ORDERS; order++){
+            mem_reset_brk();
+            mm_set_policy(fit, order);
+            run(ops, live, seed, lat, count, &res);
+            mm_stats(&st);
+            printf("%5s,%-8s %12.0f %11.1f%% %14.2f\n", fit_names[fit],
+                  order_names[order], ops / (res.elapsed / 1e9),
+                  100.0 * res.peak_bytes / res.heap_size, st.fit_searches ?
+                  (double)st.fit_steps / st.fit_searches : 0.0);
+         }
+      }
+      return 0;
+   }
+
+   mm_set_policy(fit, order);
+   run(ops, live, seed, lat, count, &res);
+
+   printf("mode %s, %s fit, %s order: %ld ops in %.3f s, %.0f ops/s\n",
+         MODE, fit_names[fit], order_names[order], ops, res.elapsed / 1e9,
+         ops / (res.elapsed / 1e9));
+   printf("peak live %zu bytes, heap %zu bytes, utilization %.1f%%\n",
+         res.peak_bytes, res.heap_size,
+         100.0 * res.peak_bytes / res.heap_size);
+   for (int x = 0; x < NO_OPS; x++){
+      report(op_names[x], lat[x], count[x]);
+   }
+
+   mm_stats(&st);
+   printf("find_fit %.2f steps per search, %lu splits, %lu coalesces, "
+         "%lu grows\n", st.fit_searches ? (double)st.fit_steps /
+         st.fit_searches : 0.0, st.splits, st.coalesces, st.grows);
+   printf("heap grown %lu times by %zu bytes on average, %.1f%% of the heap "
+         "marked for huge pages\n", st.grows, st.grows ? st.grow_bytes /
+         st.grows : 0, st.heap_size ? 100.0 * st.huge_bytes / st.heap_size :
+         0.0);
+   printf("heap blocks per bin:");
+   for (int x = 0; x < st.nbins; x++){
+      if (st.allocs[x])
+         printf(" %d:%lu", x, st.allocs[x]);
+   }
+   printf("\n");
+   return 0;
+}
+
+/*
+ * run - Initializes a fresh heap and runs the seeded workload on it,
+ * recording the latency of each call in lat and the calls of each kind in
+ * count. Exits if an allocation fails.
+ */
+static void run(long ops, long live, unsigned seed, long **lat, long *count,
+      struct result *res)
+{
+   void **slot = calloc(live, sizeof(void *));
+   size_t *slot_size = calloc(live, sizeof(size_t));
+   if (!slot || !slot_size){
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+   }
+   if (mm_init() < 0){
+      fprintf(stderr, "mm_init failed\n");
+      exit(1);
+   }
+   srand(seed);
+   for (int x = 0; x < NO_OPS; x++){
+      count[x] = 0;
+   }
+
+   size_t live_bytes = 0, peak_bytes = 0;
+   long start = now_ns();
+   for (long i = 0; i < ops; i++){
+      long s = rand() % live;
+      int op;
+      size_t size = 0;
+      long t0, t1;
+
+      if (slot[s] == NULL)
+         op = OP_MALLOC;
+      else
+         op = (rand() % 4 == 0) ? OP_REALLOC : OP_FREE;
+      if (op != OP_FREE)
+         size = rand_size();
+
+      t0 = now_ns();
+      if (op == OP_MALLOC)
+         slot[s] = mm_malloc(size);
+      else if (op == OP_REALLOC)
+         slot[s] = mm_realloc(slot[s], size);
+      else
+         mm_free(slot[s]);
+      t1 = now_ns();
+      lat[op][count[op]++] = t1 - t0;
+
+      if (op != OP_FREE && slot[s] == NULL){
+         fprintf(stderr, "allocation of %zu bytes failed\n", size);
+         exit(1);
+      }
+      live_bytes += size - slot_size[s];
+      slot_size[s] = size;
+      if (op == OP_FREE)
+         slot[s] = NULL;
+      if (live_bytes > peak_bytes)
+         peak_bytes = live_bytes;
+   }
+   res->elapsed = now_ns() - start;
+   res->peak_bytes = peak_bytes;
+   res->heap_size = mem_heapsize();
+   free(slot);
+   free(slot_size);
+}
+
+/*
+ * lookup - Returns the index of name in the n names, or -1.
+ */
+static int lookup(const char *name, const char **names, int n)
+{
+   for (int x = 0; x < n; x++){
+      if (strcmp(name, names[x]) == 0)
+         return x;
+   }
+   return -1;
+}
+
+static void usage(const char *prog)
+{
+   fprintf(stderr, "usage: %s [-A] [-n ops] [-l live] [-s seed] "
+         "[-f first|next|best|good] [-o lifo|address]\n", prog);
+   exit(1);
+}
+
+/*
+ * rand_size - Returns a size drawn log-uniformly from 16 bytes to 256KB.
+ */
+static size_t rand_size(void)
+{
+   int shift = 4 + rand() % 14;
+   return ((size_t)1 << shift) + rand() % ((size_t)1 << shift);
+}
+
+/*
+ * now_ns - Monotonic clock in nanoseconds.
+ */
+static long now_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+   long x = *(const long *)a, y = *(const long *)b;
+   return (x > y) - (x < y);
+}
+
+/*
+ * report - Prints latency percentiles of the n samples in lat.
+ */
+static void report(const char *name, long *lat, long n)
+{
+   if (n == 0)
+      return;
+   qsort(lat, n, sizeof(long), cmp_long);
+   printf("%-8s n=%-8ld p50 %5ld ns  p99 %6ld ns  p99.9 %7ld ns  max %8ld ns\n",
+         name, n, lat[n / 2], lat[n * 99 / 100], lat[n * 999 / 1000],
+         lat[n - 1]);
+}
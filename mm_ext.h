@@ -0,0 +1,191 @@
+/*
+ * mm_ext.h
+ *
+ * Extensions to the mm.h interface that are specific to mm.c. These are
+ * not part of the standard malloc family and are declared separately so
+ * that mm.h stays identical to the driver's copy.
+ */
+
+#ifndef MM_EXT_H
+#define MM_EXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Requests of at least bytes are given their own anonymous mapping instead
+ * of a block in the heap. Pass (size_t)-1 to turn the mmap path off. */
+void mm_set_mmap_threshold(size_t bytes);
+
+/* Releases free memory back to the system, returns the bytes released */
+size_t mm_trim(void);
+
+/* The heap is trimmed automatically each time bytes have been freed while
+ * at least bytes are free. Pass (size_t)-1 to only trim through mm_trim. */
+void mm_set_trim_threshold(size_t bytes);
+
+/* Soft limit on the bytes taken from the system, heap and mapped chunks
+ * together. Before the heap grows or a chunk is mapped past the limit the
+ * pressure callbacks are called in the order they were added, each with the
+ * bytes still wanted and its arg, until they report that much released. The
+ * request is then retried and only grows past the limit if that fails.
+ * Callbacks run with the heap lock held: they may free but must not
+ * allocate, nor wait for a lock another thread holds while allocating. Pass
+ * 0 to remove the limit. */
+typedef size_t (*mm_pressure_fn)(size_t want, void *arg);
+void mm_set_limit(size_t bytes);
+
+/* Adds/removes a pressure callback. Adding returns -1 if MM_PRESSURE_MAX
+ * callbacks are registered, removing returns -1 if fn and arg are not. */
+#define MM_PRESSURE_MAX 16
+int mm_add_pressure_callback(mm_pressure_fn fn, void *arg);
+int mm_remove_pressure_callback(mm_pressure_fn fn, void *arg);
+
+/* Heap profiler. Once a rate is set, about one allocation in every rate
+ * bytes allocated is sampled with its call stack, 0 stops sampling. The
+ * preloaded library reads the rate from MM_PROFILE and writes a pprof
+ * profile to MM_PROFILE_OUT.<pid> at exit. */
+void mm_set_sample_rate(size_t rate);
+
+/* Writes the sampled live and total bytes per call stack to fd, as a pprof
+ * text heap profile or as folded stacks of the live or total bytes for
+ * flamegraph.pl. Returns -1 if a write failed. */
+#define MM_PROFILE_PPROF 0
+#define MM_PROFILE_LIVE 1
+#define MM_PROFILE_TOTAL 2
+int mm_profile_dump(int fd, int format);
+
+/* Placement policies and free list orders for mm_set_policy. The default is
+ * first fit with LIFO lists. */
+#define MM_FIT_FIRST 0
+#define MM_FIT_NEXT 1
+#define MM_FIT_BEST 2
+#define MM_FIT_GOOD 3
+#define MM_ORDER_LIFO 0
+#define MM_ORDER_ADDRESS 1
+
+/* Picks the policies of the heap created by the next mm_init. The preloaded
+ * library reads them from MM_POLICY, e.g. MM_POLICY=best,address. */
+void mm_set_policy(int fit, int order);
+
+/* Builds with -DHEAP_CHECK check the heap each time the heap lock is
+ * released. MM_CHECK_FULL runs mm_checkheap, MM_CHECK_DIRTY (the default)
+ * only checks the blocks touched since the last check. Only a random one in
+ * one_in releases is checked. Other builds ignore the setting. */
+#define MM_CHECK_OFF 0
+#define MM_CHECK_FULL 1
+#define MM_CHECK_DIRTY 2
+void mm_set_check(int mode, unsigned one_in);
+
+/* Upper bound on the number of free list bins reported by mm_stats */
+#define MM_STATS_BINS 224
+
+/* Allocator counters, all counted since mm_init. Shared heap events are
+ * counted per free list bin of the block size. Thread cache hits are
+ * folded in whenever a thread refills or flushes its cache, so they may
+ * lag behind for other threads. */
+struct mm_stats {
+   size_t heap_size;          /* bytes obtained through mem_sbrk */
+   size_t live_bytes;         /* heap bytes in blocks outside the free lists */
+   size_t free_bytes;         /* heap bytes in the free lists */
+   size_t mapped_bytes;       /* bytes in chunks mapped on their own */
+   unsigned long grows;       /* grow_heap calls */
+   size_t grow_bytes;         /* bytes added by grow_heap */
+   size_t huge_bytes;         /* heap bytes marked MADV_HUGEPAGE */
+   unsigned long pressure_events; /* times the pressure callbacks were run */
+   unsigned long limit_overruns;  /* grows past the soft limit */
+   unsigned long splits;      /* blocks split by place or a shrink */
+   unsigned long coalesces;   /* neighbours merged by coalesce */
+   unsigned long fit_searches;/* find_fit calls */
+   unsigned long fit_steps;   /* free blocks looked at by find_fit */
+   unsigned long fast_hits;   /* heap allocations served by a fast bin */
+   unsigned long consolidations; /* times the fast bins were emptied */
+   unsigned long cache_allocs;/* malloc calls served by a thread cache */
+   unsigned long cache_frees; /* free calls taken by a thread cache */
+   unsigned long slab_allocs;
+   unsigned long slab_frees;
+   unsigned long mmap_allocs;
+   unsigned long mmap_frees;
+   unsigned long remote_frees;/* blocks freed into the inbox of a locked heap */
+   int nbins;                 /* free list bins in use */
+   unsigned long allocs[MM_STATS_BINS];
+   unsigned long frees[MM_STATS_BINS];
+};
+
+/* Copies the current counters into st */
+void mm_stats(struct mm_stats *st);
+
+/* Heap layout written by mm_dump_layout: a header followed by a record for
+ * every heap block in address order, then records that mark allocated
+ * blocks which are really free in a fast bin or in the calling thread's
+ * cache. Mapped chunks are only counted in the header. mm_layout.c reads
+ * this format. */
+#define MM_LAYOUT_MAGIC 0x3154594c4d4dULL   /* "MMLYT1" */
+#define MM_LAYOUT_ALLOC 1
+#define MM_LAYOUT_FREE 2
+#define MM_LAYOUT_SLAB 3     /* allocated run of small objects */
+#define MM_LAYOUT_FAST 4     /* allocated block held in a fast bin */
+#define MM_LAYOUT_CACHED 5   /* allocated block held in a thread cache */
+
+struct mm_layout_header {
+   uint64_t magic;
+   uint64_t heap_size;        /* bytes obtained through mem_sbrk */
+   uint64_t mapped_bytes;     /* bytes in chunks mapped on their own */
+   uint32_t nbins;            /* free list bins */
+   uint32_t tlsf;             /* 1 if the bins are TLSF lists */
+};
+
+struct mm_layout_rec {
+   uint64_t offset;           /* payload offset from the first block */
+   uint32_t size;             /* block size, header included */
+   uint32_t spare;            /* free bytes inside the block, slabs only */
+   uint32_t bin;              /* free list bin of the size */
+   uint32_t kind;             /* MM_LAYOUT_ kind */
+};
+
+/* Writes the heap layout to fd under the heap lock. Returns -1 if a write
+ * failed. */
+int mm_dump_layout(int fd);
+
+/* Allocates n blocks of size bytes into out, carving them from as few free
+ * blocks as possible. Returns the number allocated, which is less than n
+ * only if memory ran out. */
+size_t mm_malloc_batch(size_t size, size_t n, void **out);
+
+/* Frees the n pointers in ptrs, NULL entries are skipped. Neighbouring
+ * blocks are merged before coalescing. ptrs is sorted in the process. */
+void mm_free_batch(void **ptrs, size_t n);
+
+/* Aligned allocation. align must be a power of two, and for posix_memalign
+ * also a multiple of sizeof(void *). The driver build renames these like
+ * the rest of the malloc family. */
+#ifdef DRIVER
+void *mm_memalign(size_t align, size_t size);
+int mm_posix_memalign(void **memptr, size_t align, size_t size);
+void *mm_aligned_alloc(size_t align, size_t size);
+#else
+void *memalign(size_t align, size_t size);
+#endif
+
+/* Bytes usable at an allocated pointer, at least the size asked for */
+#ifdef DRIVER
+size_t mm_malloc_usable_size(void *ptr);
+#else
+size_t malloc_usable_size(void *ptr);
+#endif
+
+/* Arenas bump allocate objects that are freed all at once. They take
+ * chunk_size byte chunks (a default size if 0) from the heap and are not
+ * safe to share between threads without locking. */
+struct mm_arena;
+struct mm_arena *mm_arena_create(size_t chunk_size);
+
+/* Returns size bytes from the arena, NULL if size is 0 or out of memory */
+void *mm_arena_alloc(struct mm_arena *a, size_t size);
+
+/* Frees every object of the arena, keeping one chunk for reuse */
+void mm_arena_reset(struct mm_arena *a);
+
+/* Frees the arena and everything allocated from it */
+void mm_arena_destroy(struct mm_arena *a);
+
+#endif /* MM_EXT_H */
@@ -0,0 +1,399 @@
+/*
+ * mm_layout.c
+ *
+ * Reads heap layouts written by mm_dump_layout (format in mm_ext.h) and
+ * reports where the heap went: allocated, free, idle in a fast bin or a
+ * thread cache, or spare inside slabs. Free space is broken down by bin with
+ * the largest block of each, external fragmentation is given as one minus
+ * the largest free block over all free bytes, and a histogram shows how
+ * many bytes are wasted in holes of each power of two. Blocks held in fast
+ * bins or caches are counted apart from the free lists, together with the
+ * largest run of free and held blocks that a consolidation could merge.
+ *
+ * It only needs the header, not mm.c:
+ *
+ *   gcc -O2 -o mm_layout mm_layout.c
+ *   mm_replay -f first -L first.lyt app.trace
+ *   mm_replay -f best -L best.lyt app.trace
+ *   mm_layout first.lyt best.lyt
+ *
+ * Usage: mm_layout [-m] [-w width] layout...
+ *
+ * -m draws a map of the heap, width characters to a row, where '#' is
+ * allocated, 's' a slab, 'h' held in a fast bin or cache and '.' free. With
+ * more than one layout a summary line for each follows the reports, which
+ * is the quickest way to see which part of the heap a policy change moved.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mm_ext.h"
+
+/* Holes are grouped by the power of two below their size */
+#define NO_HIST 33
+
+/* Rows of the heap map */
+#define MAP_ROWS 16
+
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+
+/* A layout as read from a file, heap records only, in address order */
+struct layout {
+   const char *path;
+   struct mm_layout_header hdr;
+   struct mm_layout_rec *rec;
+   size_t n;
+};
+
+/* Free space of one bin */
+struct bin_use {
+   size_t count;
+   uint64_t bytes;
+   uint64_t largest;
+};
+
+/* What a layout adds up to */
+struct summary {
+   size_t blocks;
+   uint64_t alloc_bytes;
+   uint64_t slab_bytes;
+   uint64_t slab_spare;
+   uint64_t free_bytes;
+   uint64_t held_bytes;
+   uint64_t largest_free;
+   uint64_t largest_run;
+   size_t nfree;
+   size_t nheld;
+   uint64_t hist_count[NO_HIST];
+   uint64_t hist_bytes[NO_HIST];
+   struct bin_use *bins;
+   uint32_t nbins;
+};
+
+/* Function prototypes */
+static void load_layout(const char *path, struct layout *l);
+static void apply_overlay(struct layout *l, const struct mm_layout_rec *o);
+static void summarize(const struct layout *l, struct summary *s);
+static void add_hole(struct summary *s, uint64_t bytes);
+static void report(const struct layout *l, const struct summary *s);
+static void draw_map(const struct layout *l, int width);
+static double pct(uint64_t part, uint64_t whole);
+static int log2_floor(uint64_t x);
+static void usage(const char *prog);
+
+/*
+ * main - Parses options, then reads, reports and optionally maps each
+ * layout, and compares them if there are several.
+ */
+int main(int argc, char **argv)
+{
+   int c, map = 0, width = 64;
+
+   while ((c = getopt(argc, argv, "mw:")) != -1){
+      switch (c){
+      case 'm': map = 1; break;
+      case 'w':
+         if ((width = atoi(optarg)) <= 0)
+            usage(argv[0]);
+         break;
+      default: usage(argv[0]);
+      }
+   }
+   if (optind == argc)
+      usage(argv[0]);
+
+   int nfiles = argc - optind;
+   struct layout *l = calloc(nfiles, sizeof(*l));
+   struct summary *s = calloc(nfiles, sizeof(*s));
+   if (!l || !s){
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+   }
+   for (int x = 0; x < nfiles; x++){
+      load_layout(argv[optind + x], &l[x]);
+      summarize(&l[x], &s[x]);
+      if (x > 0)
+         printf("\n");
+      report(&l[x], &s[x]);
+      if (map)
+         draw_map(&l[x], width);
+   }
+
+   if (nfiles > 1){
+      printf("\n%-20s %10s %7s %7s %7s %7s %7s %10s\n", "layout", "heap",
+            "alloc", "slab", "spare", "free", "held", "ext frag");
+      for (int x = 0; x < nfiles; x++){
+         uint64_t heap = l[x].hdr.heap_size;
+         printf("%-20.20s %10lu %6.1f%% %6.1f%% %6.1f%% %6.1f%% %6.1f%% "
+               "%9.1f%%\n", l[x].path, (unsigned long)heap,
+               pct(s[x].alloc_bytes, heap), pct(s[x].slab_bytes, heap),
+               pct(s[x].slab_spare, heap), pct(s[x].free_bytes, heap),
+               pct(s[x].held_bytes, heap), s[x].free_bytes ? 100.0 -
+               pct(s[x].largest_free, s[x].free_bytes) : 0.0);
+      }
+   }
+   return 0;
+}
+
+/*
+ * load_layout - Reads the layout at path into l. Block records are kept in
+ * address order, the fast bin and cache records that follow them turn the
+ * blocks they name from allocated into held. Exits on a malformed file.
+ */
+static void load_layout(const char *path, struct layout *l)
+{
+   FILE *f = fopen(path, "rb");
+   struct mm_layout_rec rec;
+   size_t cap = 1024;
+
+   if (f == NULL){
+      perror(path);
+      exit(1);
+   }
+   l->path = path;
+   if (fread(&l->hdr, sizeof(l->hdr), 1, f) != 1 ||
+         l->hdr.magic != MM_LAYOUT_MAGIC){
+      fprintf(stderr, "%s: not a heap layout\n", path);
+      exit(1);
+   }
+   l->n = 0;
+   if ((l->rec = malloc(cap * sizeof(rec))) == NULL){
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+   }
+   while (fread(&rec, sizeof(rec), 1, f) == 1){
+      if (rec.kind == MM_LAYOUT_FAST || rec.kind == MM_LAYOUT_CACHED){
+         apply_overlay(l, &rec);
+         continue;
+      }
+      if (rec.kind < MM_LAYOUT_ALLOC || rec.kind > MM_LAYOUT_SLAB ||
+            (l->n > 0 && rec.offset <= l->rec[l->n - 1].offset)){
+         fprintf(stderr, "%s: bad record %zu\n", path, l->n);
+         exit(1);
+      }
+      if (l->n == cap){
+         cap *= 2;
+         if ((l->rec = realloc(l->rec, cap * sizeof(rec))) == NULL){
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+         }
+      }
+      l->rec[l->n++] = rec;
+   }
+   fclose(f);
+}
+
+/*
+ * apply_overlay - Marks the allocated block at the offset of overlay o as
+ * held. Overlays for blocks that are not in the layout are ignored.
+ */
+static void apply_overlay(struct layout *l, const struct mm_layout_rec *o)
+{
+   size_t lo = 0, hi = l->n;
+
+   while (lo < hi){
+      size_t mid = lo + (hi - lo) / 2;
+      if (l->rec[mid].offset < o->offset)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+   if (lo < l->n && l->rec[lo].offset == o->offset &&
+         l->rec[lo].kind == MM_LAYOUT_ALLOC)
+      l->rec[lo].kind = o->kind;
+}
+
+/*
+ * summarize - Adds up the blocks of layout l into s.
+ */
+static void summarize(const struct layout *l, struct summary *s)
+{
+   uint64_t run = 0;
+   uint32_t nbins = l->hdr.nbins;
+
+   for (size_t x = 0; x < l->n; x++){
+      nbins = MAX(nbins, l->rec[x].bin + 1);
+   }
+   memset(s, 0, sizeof(*s));
+   s->nbins = nbins;
+   if ((s->bins = calloc(nbins ? nbins : 1, sizeof(struct bin_use))) == NULL){
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+   }
+
+   for (size_t x = 0; x < l->n; x++){
+      const struct mm_layout_rec *r = &l->rec[x];
+      struct bin_use *b = &s->bins[r->bin];
+
+      s->blocks++;
+      switch (r->kind){
+      case MM_LAYOUT_ALLOC:
+         s->alloc_bytes += r->size;
+         break;
+      case MM_LAYOUT_SLAB:
+         s->slab_bytes += r->size;
+         s->slab_spare += r->spare;
+         if (r->spare)
+            add_hole(s, r->spare);
+         break;
+      case MM_LAYOUT_FREE:
+         s->free_bytes += r->size;
+         s->largest_free = MAX(s->largest_free, r->size);
+         s->nfree++;
+         b->count++;
+         b->bytes += r->size;
+         b->largest = MAX(b->largest, r->size);
+         add_hole(s, r->size);
+         break;
+      default:
+         s->held_bytes += r->size;
+         s->nheld++;
+         add_hole(s, r->size);
+         break;
+      }
+
+      // Neighbouring free and held blocks would merge on consolidation
+      if (r->kind == MM_LAYOUT_FREE || r->kind == MM_LAYOUT_FAST ||
+            r->kind == MM_LAYOUT_CACHED)
+         run += r->size;
+      else
+         run = 0;
+      s->largest_run = MAX(s->largest_run, run);
+   }
+}
+
+/*
+ * add_hole - Counts bytes that are wasted in one piece in the histogram.
+ */
+static void add_hole(struct summary *s, uint64_t bytes)
+{
+   int b = MIN(log2_floor(bytes), NO_HIST - 1);
+   s->hist_count[b]++;
+   s->hist_bytes[b] += bytes;
+}
+
+/*
+ * report - Prints the breakdown of layout l.
+ */
+static void report(const struct layout *l, const struct summary *s)
+{
+   uint64_t heap = l->hdr.heap_size, wasted;
+   uint64_t meta = heap - MIN(heap, s->alloc_bytes + s->slab_bytes +
+         s->free_bytes + s->held_bytes);
+
+   printf("%s: %s bins, heap %lu bytes in %zu blocks, %lu bytes mapped "
+         "apart\n", l->path, l->hdr.tlsf ? "tlsf" : "segregated",
+         (unsigned long)heap, s->blocks,
+         (unsigned long)l->hdr.mapped_bytes);
+   printf("  %-22s %12lu %6.1f%%\n", "allocated",
+         (unsigned long)s->alloc_bytes, pct(s->alloc_bytes, heap));
+   printf("  %-22s %12lu %6.1f%%  %lu spare\n", "slabs",
+         (unsigned long)s->slab_bytes, pct(s->slab_bytes, heap),
+         (unsigned long)s->slab_spare);
+   printf("  %-22s %12lu %6.1f%%  in %zu blocks\n", "free",
+         (unsigned long)s->free_bytes, pct(s->free_bytes, heap), s->nfree);
+   printf("  %-22s %12lu %6.1f%%  in %zu blocks\n", "held in fast bins/cache",
+         (unsigned long)s->held_bytes, pct(s->held_bytes, heap), s->nheld);
+   printf("  %-22s %12lu %6.1f%%\n", "headers and padding",
+         (unsigned long)meta, pct(meta, heap));
+
+   printf("largest free block %lu bytes, external fragmentation %.1f%%, "
+         "largest free run after consolidation %lu bytes\n",
+         (unsigned long)s->largest_free, s->free_bytes ? 100.0 -
+         pct(s->largest_free, s->free_bytes) : 0.0,
+         (unsigned long)s->largest_run);
+
+   if (s->nfree){
+      printf("free blocks per bin:\n  %4s %8s %12s %10s\n", "bin", "blocks",
+            "bytes", "largest");
+      for (uint32_t x = 0; x < s->nbins; x++){
+         const struct bin_use *b = &s->bins[x];
+         if (b->count)
+            printf("  %4u %8zu %12lu %10lu\n", x, b->count,
+                  (unsigned long)b->bytes, (unsigned long)b->largest);
+      }
+   }
+
+   wasted = s->free_bytes + s->held_bytes + s->slab_spare;
+   if (wasted){
+      printf("wasted bytes by hole size:\n  %-14s %8s %12s %7s\n", "size",
+            "holes", "bytes", "share");
+      for (int x = 0; x < NO_HIST; x++){
+         char range[32];
+         if (s->hist_count[x] == 0)
+            continue;
+         snprintf(range, sizeof(range), "%llu-%llu", 1ULL << x,
+               (2ULL << x) - 1);
+         printf("  %-14s %8lu %12lu %6.1f%%\n", range,
+               (unsigned long)s->hist_count[x],
+               (unsigned long)s->hist_bytes[x], pct(s->hist_bytes[x], wasted));
+      }
+   }
+}
+
+/*
+ * draw_map - Draws layout l as MAP_ROWS rows of width cells. Each cell shows
+ * what most of its bytes are used for.
+ */
+static void draw_map(const struct layout *l, int width)
+{
+   size_t cells = (size_t)width * MAP_ROWS;
+   uint64_t heap = MAX(l->hdr.heap_size, 1), (*use)[4];
+   static const char marks[] = "#sh.";
+
+   if ((use = calloc(cells, sizeof(*use))) == NULL){
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+   }
+   for (size_t x = 0; x < l->n; x++){
+      const struct mm_layout_rec *r = &l->rec[x];
+      uint64_t start = r->offset, end = r->offset + r->size;
+      int k = r->kind == MM_LAYOUT_ALLOC ? 0 : r->kind == MM_LAYOUT_SLAB ? 1 :
+         r->kind == MM_LAYOUT_FREE ? 3 : 2;
+
+      // Spread the block over the cells it covers
+      while (start < end && start < heap){
+         size_t cell = start * cells / heap;
+         uint64_t cell_end = ((cell + 1) * heap + cells - 1) / cells;
+         uint64_t part = MIN(end, MAX(cell_end, start + 1)) - start;
+         use[cell][k] += part;
+         start += part;
+      }
+   }
+
+   printf("heap map, %lu bytes per cell:\n", (unsigned long)(heap / cells ?
+         heap / cells : 1));
+   for (size_t x = 0; x < cells; x++){
+      int best = -1;
+      for (int k = 0; k < 4; k++){
+         if (use[x][k] && (best < 0 || use[x][k] > use[x][best]))
+            best = k;
+      }
+      if ((int)(x % width) == 0)
+         printf("  ");
+      putchar(best < 0 ? ' ' : marks[best]);
+      if ((int)(x % width) == width - 1)
+         putchar('\n');
+   }
+   free(use);
+}
+
+static double pct(uint64_t part, uint64_t whole)
+{
+   return whole ? 100.0 * part / whole : 0.0;
+}
+
+static int log2_floor(uint64_t x)
+{
+   return x ? 63 - __builtin_clzll(x) : 0;
+}
+
+static void usage(const char *prog)
+{
+   fprintf(stderr, "usage: %s [-m] [-w width] layout...\n", prog);
+   exit(1);
+}
@@ -0,0 +1,424 @@
+/*
+ * mm_replay.c
+ *
+ * Replays a trace recorded by mm_trace.c against mm.c or against the C
+ * library's allocator, and reports throughput, peak utilization and latency
+ * percentiles for each operation. Pointers in the trace are mapped to slots
+ * before the replay starts, so the timed loop only makes allocator calls.
+ * Calls on pointers the trace never saw allocated, and calls that failed in
+ * the traced process, are skipped. Requests for zero bytes are replayed as
+ * they were made, and each allocator may answer them with NULL or a block.
+ *
+ * The replay driver links against mm.c and the memlib.c simulator, the C
+ * library's allocator stays reachable through the DRIVER aliases:
+ *
+ *   gcc -O2 -DDRIVER -o mm_replay mm_replay.c mm.c memlib.c -lpthread
+ *
+ * Usage: mm_replay [-a mm|libc] [-f fit] [-o order] [-L layout] trace
+ *
+ * -f and -o pick the placement policy (first, next, best or good) and the
+ * free list order (lifo or address) of mm.c, see mm_set_policy. -L writes
+ * the heap layout of mm.c at the end of the replay to a file for
+ * mm_layout.c, so that two policies can be compared block by block.
+ *
+ * traces/zero.trace mixes zero byte malloc, calloc and realloc calls with
+ * calls on their results, and must replay cleanly against both allocators.
+ *
+ * Utilization is the peak of the live requested bytes over the peak
+ * footprint, which is the heap plus the mapped chunks for mm.c and the
+ * arena plus the mapped chunks reported by mallinfo2 for the C library.
+ */
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "mm.h"
+#include "mm_ext.h"
+#include "mm_trace.h"
+#include "memlib.h"
+
+/* Footprint is sampled, outside the timed calls, this often */
+#define SAMPLE_EVERY 1024
+
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+/* A replayable operation on slot id */
+struct op {
+   int kind;
+   unsigned id;
+   size_t size;
+   size_t align;
+};
+
+/* Allocator under test */
+struct allocator {
+   const char *name;
+   void *(*malloc)(size_t);
+   void (*free)(void *);
+   void *(*realloc)(void *, size_t);
+   void *(*calloc)(size_t, size_t);
+   void *(*memalign)(size_t, size_t);
+   size_t (*footprint)(void);
+};
+
+/* Open addressing map from traced pointers to slot ids */
+struct ptr_map {
+   uint64_t *key;
+   unsigned *val;
+   size_t mask;
+};
+
+#define MAP_EMPTY 0
+#define MAP_GONE 1
+
+static const char *op_names[] = {"", "malloc", "free", "realloc", "calloc",
+   "memalign"};
+
+/* Policy names, indexed by the MM_FIT_ and MM_ORDER_ constants */
+static const char *fit_names[] = {"first", "next", "best", "good", NULL};
+static const char *order_names[] = {"lifo", "address", NULL};
+
+/* Function prototypes */
+static struct op *load_trace(const char *path, long *nops, unsigned *nslots);
+static void map_init(struct ptr_map *m, size_t n);
+static unsigned *map_find(struct ptr_map *m, uint64_t key);
+static void map_put(struct ptr_map *m, uint64_t key, unsigned val);
+static void map_del(struct ptr_map *m, uint64_t key);
+static size_t mm_footprint(void);
+static size_t libc_footprint(void);
+static long now_ns(void);
+static int cmp_long(const void *a, const void *b);
+static void report(const char *name, long *lat, long n);
+static int lookup(const char *name, const char **names);
+static void write_layout(const char *path);
+
+static const struct allocator allocators[] = {
+   {"mm", mm_malloc, mm_free, mm_realloc, mm_calloc, mm_memalign,
+      mm_footprint},
+   {"libc", malloc, free, realloc, calloc, memalign, libc_footprint},
+};
+
+/*
+ * main - Parses options, loads the trace, replays it and prints the report.
+ */
+int main(int argc, char **argv)
+{
+   const struct allocator *a = &allocators[0];
+   struct op *ops;
+   long nops, count[MM_TRACE_MEMALIGN + 1] = {0};
+   long *lat[MM_TRACE_MEMALIGN + 1];
+   unsigned nslots;
+   int c, bad = 0, fit = MM_FIT_FIRST, order = MM_ORDER_LIFO;
+   const char *layout = NULL;
+
+   while ((c = getopt(argc, argv, "a:f:o:L:")) != -1){
+      if (c == 'a' && strcmp(optarg, "mm") == 0)
+         a = &allocators[0];
+      else if (c == 'a' && strcmp(optarg, "libc") == 0)
+         a = &allocators[1];
+      else if (c == 'f' && (fit = lookup(optarg, fit_names)) >= 0)
+         ;
+      else if (c == 'o' && (order = lookup(optarg, order_names)) >= 0)
+         ;
+      else if (c == 'L')
+         layout = optarg;
+      else
+         bad = 1;
+   }
+   if (bad || optind != argc - 1){
+      fprintf(stderr, "usage: %s [-a mm|libc] [-f first|next|best|good] "
+            "[-o lifo|address] [-L layout] trace\n", argv[0]);
+      exit(1);
+   }
+
+   ops = load_trace(argv[optind], &nops, &nslots);
+   void **slot = calloc(nslots, sizeof(void *));
+   size_t *slot_size = calloc(nslots, sizeof(size_t));
+   for (int x = 1; x <= MM_TRACE_MEMALIGN; x++){
+      lat[x] = malloc((nops ? nops : 1) * sizeof(long));
+      if (lat[x] == NULL){
+         fprintf(stderr, "out of memory\n");
+         exit(1);
+      }
+   }
+   if (!slot || !slot_size){
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+   }
+
+   if (a->malloc == mm_malloc){
+      mem_init();
+      mm_set_policy(fit, order);
+      if (mm_init() < 0){
+         fprintf(stderr, "mm_init failed\n");
+         exit(1);
+      }
+   }
+
+   size_t live_bytes = 0, peak_bytes = 0, peak_footprint = 0;
+   long total = 0;
+   for (long i = 0; i < nops; i++){
+      struct op *op = &ops[i];
+      void *p = slot[op->id];
+      long t0, t1;
+
+      t0 = now_ns();
+      switch (op->kind){
+      case MM_TRACE_MALLOC: p = a->malloc(op->size); break;
+      case MM_TRACE_CALLOC: p = a->calloc(1, op->size); break;
+      case MM_TRACE_REALLOC: p = a->realloc(p, op->size); break;
+      case MM_TRACE_MEMALIGN: p = a->memalign(op->align, op->size); break;
+      default: a->free(p); p = NULL; break;
+      }
+      t1 = now_ns();
+      lat[op->kind][count[op->kind]++] = t1 - t0;
+      total += t1 - t0;
+
+      /* A request for no bytes may return NULL, later calls take that */
+      if (op->kind != MM_TRACE_FREE && p == NULL && op->size != 0){
+         fprintf(stderr, "%s of %zu bytes failed at op %ld\n",
+               op_names[op->kind], op->size, i);
+         exit(1);
+      }
+      slot[op->id] = p;
+      live_bytes += op->size - slot_size[op->id];
+      slot_size[op->id] = op->size;
+      if (live_bytes > peak_bytes || i % SAMPLE_EVERY == 0){
+         peak_bytes = MAX(peak_bytes, live_bytes);
+         peak_footprint = MAX(peak_footprint, a->footprint());
+      }
+   }
+   peak_footprint = MAX(peak_footprint, a->footprint());
+
+   printf("%s: %ld ops in %.3f s, %.0f ops/s\n", a->name, nops,
+         total / 1e9, total ? nops / (total / 1e9) : 0.0);
+   printf("peak live %zu bytes, footprint %zu bytes, utilization %.1f%%\n",
+         peak_bytes, peak_footprint,
+         peak_footprint ? 100.0 * peak_bytes / peak_footprint : 0.0);
+   for (int x = 1; x <= MM_TRACE_MEMALIGN; x++){
+      report(op_names[x], lat[x], count[x]);
+   }
+   if (layout != NULL && a->malloc == mm_malloc)
+      write_layout(layout);
+   return 0;
+}
+
+/*
+ * load_trace - Reads the trace at path and turns it into operations on
+ * slots. Each allocation gets a fresh slot and later calls on the pointer it
+ * returned refer to that slot. Exits on a malformed trace.
+ */
+static struct op *load_trace(const char *path, long *nops, unsigned *nslots)
+{
+   struct mm_trace_header hdr;
+   struct mm_trace_rec *rec;
+   struct ptr_map map;
+   struct stat st;
+   struct op *ops;
+   unsigned *id, next_id = 0;
+   long n, out = 0;
+   int fd;
+
+   if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0){
+      perror(path);
+      exit(1);
+   }
+   if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+         hdr.magic != MM_TRACE_MAGIC){
+      fprintf(stderr, "%s: not a trace\n", path);
+      exit(1);
+   }
+   n = (st.st_size - sizeof(hdr)) / sizeof(*rec);
+   rec = malloc((n ? n : 1) * sizeof(*rec));
+   ops = malloc((n ? n : 1) * sizeof(*ops));
+   if (!rec || !ops){
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+   }
+   if (read(fd, rec, n * sizeof(*rec)) != (ssize_t)(n * sizeof(*rec))){
+      fprintf(stderr, "%s: short read\n", path);
+      exit(1);
+   }
+   close(fd);
+
+   map_init(&map, n);
+   for (long i = 0; i < n; i++){
+      int kind = MM_TRACE_OP(rec[i].op_size);
+      size_t size = MM_TRACE_SIZE(rec[i].op_size);
+
+      /* A failed allocation left nothing to replay */
+      if (kind != MM_TRACE_FREE && rec[i].result == 0 &&
+            !(kind == MM_TRACE_REALLOC && size == 0))
+         continue;
+
+      if (kind == MM_TRACE_MALLOC || kind == MM_TRACE_CALLOC ||
+            (kind == MM_TRACE_REALLOC && rec[i].ptr == 0)){
+         /* realloc(NULL, 0) may return NULL, which is no map key */
+         if (rec[i].result != 0)
+            map_put(&map, rec[i].result, next_id);
+         ops[out++] = (struct op){kind, next_id++, size, 0};
+         continue;
+      }
+      /* The aligned calls record the alignment as their ptr */
+      if (kind == MM_TRACE_MEMALIGN){
+         map_put(&map, rec[i].result, next_id);
+         ops[out++] = (struct op){kind, next_id++, size, rec[i].ptr};
+         continue;
+      }
+      if (kind != MM_TRACE_FREE && kind != MM_TRACE_REALLOC){
+         fprintf(stderr, "%s: bad record %ld\n", path, i);
+         exit(1);
+      }
+
+      /* Pointers allocated before tracing started are not known */
+      if ((id = map_find(&map, rec[i].ptr)) == NULL)
+         continue;
+      ops[out] = (struct op){kind, *id, size, 0};
+      map_del(&map, rec[i].ptr);
+      if (kind == MM_TRACE_REALLOC && size == 0)
+         ops[out].kind = MM_TRACE_FREE;
+      else if (kind == MM_TRACE_REALLOC)
+         map_put(&map, rec[i].result, ops[out].id);
+      out++;
+   }
+   free(rec);
+   free(map.key);
+   free(map.val);
+   *nops = out;
+   *nslots = next_id ? next_id : 1;
+   return ops;
+}
+
+/*
+ * map_init - Sizes the map for up to n live pointers.
+ */
+static void map_init(struct ptr_map *m, size_t n)
+{
+   size_t cap = 16;
+   while (cap < 2 * n)
+      cap <<= 1;
+   m->key = calloc(cap, sizeof(uint64_t));
+   m->val = malloc(cap * sizeof(unsigned));
+   m->mask = cap - 1;
+   if (!m->key || !m->val){
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+   }
+}
+
+/*
+ * map_find - Returns the slot id of key, or NULL if it is not mapped.
+ */
+static unsigned *map_find(struct ptr_map *m, uint64_t key)
+{
+   size_t x = (key >> 4) * 0x9e3779b97f4a7c15ULL & m->mask;
+   for (; m->key[x] != MAP_EMPTY; x = (x + 1) & m->mask){
+      if (m->key[x] == key)
+         return &m->val[x];
+   }
+   return NULL;
+}
+
+/*
+ * map_put - Maps key to val, replacing an earlier mapping of key.
+ */
+static void map_put(struct ptr_map *m, uint64_t key, unsigned val)
+{
+   unsigned *v;
+   size_t x;
+   if ((v = map_find(m, key)) != NULL){
+      *v = val;
+      return;
+   }
+   x = (key >> 4) * 0x9e3779b97f4a7c15ULL & m->mask;
+   while (m->key[x] != MAP_EMPTY && m->key[x] != MAP_GONE)
+      x = (x + 1) & m->mask;
+   m->key[x] = key;
+   m->val[x] = val;
+}
+
+/*
+ * map_del - Removes key, leaving a marker so that later probes continue.
+ */
+static void map_del(struct ptr_map *m, uint64_t key)
+{
+   unsigned *v;
+   if ((v = map_find(m, key)) != NULL)
+      m->key[v - m->val] = MAP_GONE;
+}
+
+/*
+ * mm_footprint, libc_footprint - Bytes the allocator holds from the system.
+ */
+static size_t mm_footprint(void)
+{
+   struct mm_stats st;
+   mm_stats(&st);
+   return st.heap_size + st.mapped_bytes;
+}
+
+static size_t libc_footprint(void)
+{
+   struct mallinfo2 mi = mallinfo2();
+   return mi.arena + mi.hblkhd;
+}
+
+/*
+ * now_ns - Monotonic clock in nanoseconds.
+ */
+static long now_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+   long x = *(const long *)a, y = *(const long *)b;
+   return (x > y) - (x < y);
+}
+
+/*
+ * lookup - Returns the index of name in the NULL terminated names, or -1.
+ */
+static int lookup(const char *name, const char **names)
+{
+   for (int x = 0; names[x] != NULL; x++){
+      if (strcmp(name, names[x]) == 0)
+         return x;
+   }
+   return -1;
+}
+
+/*
+ * report - Prints latency percentiles of the n samples in lat.
+ */
+static void report(const char *name, long *lat, long n)
+{
+   if (n == 0)
+      return;
+   qsort(lat, n, sizeof(long), cmp_long);
+   printf("%-8s n=%-8ld p50 %5ld ns  p99 %6ld ns  p99.9 %7ld ns  max %8ld ns\n",
+         name, n, lat[n / 2], lat[n * 99 / 100], lat[n * 999 / 1000],
+         lat[n - 1]);
+}
+
+/*
+ * write_layout - Writes the heap layout of mm.c to path. Exits on failure.
+ */
+static void write_layout(const char *path)
+{
+   int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0 || mm_dump_layout(fd) < 0){
+      fprintf(stderr, "can not write layout to %s\n", path);
+      exit(1);
+   }
+   close(fd);
+}
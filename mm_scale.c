@@ -0,0 +1,802 @@
+/*
+ * mm_scale.c
+ *
+ * Scalability benchmark for mm.c. Runs classic multithreaded allocator
+ * stress patterns at a growing number of threads and reports throughput,
+ * how it scales from one thread, peak resident memory, the allocator's
+ * footprint and, where the kernel allows it, hardware counters per call:
+ *
+ *   larson    each thread frees and replaces random blocks of 8 to 1000
+ *             bytes in an array of slots, and the arrays move on to the
+ *             next thread every round, so most frees are of blocks another
+ *             thread allocated (Larson and Krishnan)
+ *   thread    each thread allocates a batch of 64 byte blocks and frees
+ *             them again, with no sharing at all (threadtest from Hoard)
+ *   prodcons  threads form a ring, each allocates blocks of 16 bytes to
+ *             4KB and hands them to the next thread to free
+ *   realloc   each thread grows buffers by half again with realloc until
+ *             they pass 256KB, then starts them over
+ *   proxy     each thread serves requests like proxy.c: a small argument
+ *             block, a line buffer, header strings and a response buffer
+ *             that is shrunk and put in a shared LRU cache, whose evictions
+ *             free objects other threads allocated
+ *
+ * Every thread makes the same number of calls, so ideal scaling keeps the
+ * time constant and the throughput grows with the threads. Each run is
+ * made in a child process of its own, which gives it a fresh heap and an
+ * honest peak RSS. The driver links against mm.c and the memlib.c
+ * simulator, the C library's allocator stays reachable through the DRIVER
+ * aliases for comparison:
+ *
+ *   gcc -O2 -DDRIVER -o mm_scale mm_scale.c mm.c memlib.c -lpthread
+ *
+ * Usage: mm_scale [-a mm|libc] [-w workload] [-t threads] [-n calls] [-s seed]
+ *
+ * -w runs one workload instead of all of them, -t sets the largest number
+ * of threads (default the online CPUs), which is reached by doubling from
+ * one, and -n the allocator calls made by each thread.
+ *
+ * Cycles, last level cache misses and L1 data cache read misses come from
+ * perf_event_open with the counters inherited by the worker threads. They
+ * show as "-" when the kernel or the machine does not provide them, see
+ * /proc/sys/kernel/perf_event_paranoid.
+ */
+
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "mm.h"
+#include "mm_ext.h"
+#include "memlib.h"
+
+/* larson: slots per thread, and calls between two hand overs */
+#define LARSON_SLOTS 1000
+#define LARSON_ROUND 10000
+
+/* thread: blocks per batch and their size */
+#define BATCH 1000
+#define BATCH_SIZE 64
+
+/* prodcons: blocks in flight between two threads, a power of two */
+#define RING_SIZE 1024
+
+/* realloc: buffers per thread and the size they are started over at */
+#define GROW_SLOTS 64
+#define GROW_MAX (256 * 1024)
+
+/* proxy: limits from proxy.c, distinct objects, and headers per request */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+#define MAXLINE 8192
+#define NO_URLS 4096
+#define NO_HEADERS 8
+
+#define NO_COUNTERS 3
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+/* Allocator under test */
+struct allocator {
+   const char *name;
+   void *(*malloc)(size_t);
+   void (*free)(void *);
+   void *(*realloc)(void *, size_t);
+   size_t (*footprint)(void);
+};
+
+/* A worker thread. calls is set by the workload to the calls it made. */
+struct worker {
+   pthread_t tid;
+   int id;
+   uint64_t seed;
+   long calls;
+};
+
+/* A workload: per run setup and cleanup outside the timed section, and
+ * the body each thread runs */
+struct workload {
+   const char *name;
+   void (*setup)(int nthreads);
+   void (*run)(struct worker *w);
+   void (*cleanup)(int nthreads);
+};
+
+/* What a child sends back about its run */
+struct result {
+   long elapsed;
+   long calls;
+   size_t footprint;
+   int64_t counters[NO_COUNTERS];
+};
+
+/* Single producer, single consumer queue of blocks */
+struct ring {
+   void *slot[RING_SIZE];
+   unsigned long head __attribute__((aligned(64)));
+   unsigned long tail __attribute__((aligned(64)));
+   int done;
+} __attribute__((aligned(64)));
+
+/* A cached proxy response */
+struct cache_entry {
+   struct cache_entry *prev, *next;
+   unsigned url;
+   size_t size;
+   char *buf;
+};
+
+/* Hardware counters, in the order they are reported */
+static const struct {
+   const char *name;
+   uint32_t type;
+   uint64_t config;
+} counter_defs[NO_COUNTERS] = {
+   {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+   {"llc-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+   {"l1d-miss", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+
+static const struct allocator *alloc;
+static const struct workload *current;
+static uint64_t seed = 1;
+static long calls_per_thread;
+static int nworkers;
+static pthread_barrier_t start_barrier;
+
+/* larson */
+static void **larson_slots;
+static size_t *larson_sizes;
+static pthread_barrier_t round_barrier;
+
+/* prodcons */
+static struct ring *rings;
+
+/* proxy */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry *cache_urls[NO_URLS];
+static struct cache_entry cache_lru;
+static size_t cache_bytes;
+
+/* Function prototypes */
+static void run_child(const struct workload *wl, int nthreads, int fd);
+static int run(const struct workload *wl, int nthreads, struct result *res,
+      long *maxrss);
+static void *worker_main(void *arg);
+static void larson_setup(int nthreads);
+static void larson_run(struct worker *w);
+static void larson_cleanup(int nthreads);
+static void thread_run(struct worker *w);
+static void prodcons_setup(int nthreads);
+static void prodcons_run(struct worker *w);
+static int ring_pop_free(struct ring *r);
+static void realloc_run(struct worker *w);
+static void proxy_setup(int nthreads);
+static void proxy_run(struct worker *w);
+static void proxy_cleanup(int nthreads);
+static int cache_insert(unsigned url, char *buf, size_t size);
+static int cache_hit(unsigned url);
+static void lru_unlink(struct cache_entry *e);
+static void lru_push(struct cache_entry *e);
+static void *checked(void *p);
+static int perf_open(int x);
+static size_t mm_footprint(void);
+static size_t libc_footprint(void);
+static uint64_t next_rand(uint64_t *s);
+static size_t rand_size(uint64_t *s, size_t lo, size_t hi);
+static long now_ns(void);
+static void usage(const char *prog);
+
+static const struct allocator allocators[] = {
+   {"mm", mm_malloc, mm_free, mm_realloc, mm_footprint},
+   {"libc", malloc, free, realloc, libc_footprint},
+};
+
+static const struct workload workloads[] = {
+   {"larson", larson_setup, larson_run, larson_cleanup},
+   {"thread", NULL, thread_run, NULL},
+   {"prodcons", prodcons_setup, prodcons_run, NULL},
+   {"realloc", NULL, realloc_run, NULL},
+   {"proxy", proxy_setup, proxy_run, proxy_cleanup},
+};
+#define NO_WORKLOADS (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+/*
+ * main - Parses options and runs each chosen workload at 1, 2, 4 and so on
+ * up to the largest number of threads, printing a line for each run.
+ */
+int main(int argc, char **argv)
+{
+   const char *only = NULL;
+   int c, max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+   alloc = &allocators[0];
+   calls_per_thread = 1000000;
+   while ((c = getopt(argc, argv, "a:w:t:n:s:")) != -1){
+      switch (c){
+      case 'a':
+         if (strcmp(optarg, "mm") == 0)
+            alloc = &allocators[0];
+         else if (strcmp(optarg, "libc") == 0)
+            alloc = &allocators[1];
+         else
+            usage(argv[0]);
+         break;
+      case 'w': only = optarg; break;
+      case 't': max_threads = atoi(optarg); break;
+      case 'n': calls_per_thread = atol(optarg); break;
+      case 's': seed = strtoull(optarg, NULL, 0); break;
+      default: usage(argv[0]);
+      }
+   }
+   int found = only == NULL;
+   for (int w = 0; w < NO_WORKLOADS && !found; w++){
+      found = strcmp(only, workloads[w].name) == 0;
+   }
+   if (!found || optind != argc || max_threads < 1 || calls_per_thread < 1)
+      usage(argv[0]);
+
+   printf("%s allocator, %ld calls per thread\n", alloc->name,
+         calls_per_thread);
+   printf("%-9s %7s %12s %6s %10s %10s", "workload", "threads", "calls/s",
+         "scale", "peak RSS", "footprint");
+   for (int x = 0; x < NO_COUNTERS; x++){
+      printf(" %9s", counter_defs[x].name);
+   }
+   printf("\n");
+
+   for (int w = 0; w < NO_WORKLOADS; w++){
+      double base = 0;
+      if (only != NULL && strcmp(only, workloads[w].name) != 0)
+         continue;
+      for (int t = 1; ; t = MIN(t * 2, max_threads)){
+         struct result res;
+         long maxrss;
+         if (run(&workloads[w], t, &res, &maxrss) < 0){
+            fprintf(stderr, "%s with %d threads failed\n", workloads[w].name,
+                  t);
+            exit(1);
+         }
+         double rate = res.calls / (res.elapsed / 1e9);
+         if (t == 1)
+            base = rate;
+         printf("%-9s %7d %12.0f %5.2fx %8ldKB %8zuKB", workloads[w].name, t,
+               rate, base ? rate / base : 0.0, maxrss, res.footprint / 1024);
+         for (int x = 0; x < NO_COUNTERS; x++){
+            if (res.counters[x] < 0)
+               printf(" %9s", "-");
+            else
+               printf(" %9.1f", (double)res.counters[x] / res.calls);
+         }
+         printf("\n");
+         fflush(stdout);
+         if (t == max_threads)
+            break;
+      }
+   }
+   printf("counters are per call\n");
+   return 0;
+}
+
+/*
+ * run - Runs workload wl with nthreads threads in a child process, fills in
+ * res and the child's peak RSS in KB. Returns -1 if the child failed.
+ */
+static int run(const struct workload *wl, int nthreads, struct result *res,
+      long *maxrss)
+{
+   struct rusage ru;
+   int fds[2], status;
+   pid_t pid;
+
+   if (pipe(fds) < 0)
+      return -1;
+   fflush(stdout);
+   if ((pid = fork()) < 0)
+      return -1;
+   if (pid == 0){
+      close(fds[0]);
+      run_child(wl, nthreads, fds[1]);
+      _exit(0);
+   }
+   close(fds[1]);
+   ssize_t n = read(fds[0], res, sizeof(*res));
+   close(fds[0]);
+   if (wait4(pid, &status, 0, &ru) < 0 || !WIFEXITED(status) ||
+         WEXITSTATUS(status) != 0 || n != sizeof(*res))
+      return -1;
+   *maxrss = ru.ru_maxrss;
+   return 0;
+}
+
+/*
+ * run_child - Sets up the heap and the workload, times its threads between
+ * the start barrier and the last join, and writes the result to fd.
+ */
+static void run_child(const struct workload *wl, int nthreads, int fd)
+{
+   struct worker *w = calloc(nthreads, sizeof(*w));
+   struct result res;
+   int perf_fd[NO_COUNTERS];
+   long start;
+
+   if (w == NULL){
+      fprintf(stderr, "out of memory\n");
+      _exit(1);
+   }
+   if (alloc->malloc == mm_malloc){
+      mem_init();
+      if (mm_init() < 0){
+         fprintf(stderr, "mm_init failed\n");
+         _exit(1);
+      }
+   }
+   current = wl;
+   nworkers = nthreads;
+   if (wl->setup != NULL)
+      wl->setup(nthreads);
+
+   /* Counters opened before the threads exist are inherited by them */
+   for (int x = 0; x < NO_COUNTERS; x++){
+      perf_fd[x] = perf_open(x);
+   }
+   pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+   for (int x = 0; x < nthreads; x++){
+      w[x].id = x;
+      w[x].seed = seed * 0x9e3779b97f4a7c15ULL + x + 1;
+      if (pthread_create(&w[x].tid, NULL, worker_main, &w[x]) != 0){
+         fprintf(stderr, "pthread_create failed\n");
+         _exit(1);
+      }
+   }
+   for (int x = 0; x < NO_COUNTERS; x++){
+      if (perf_fd[x] >= 0)
+         ioctl(perf_fd[x], PERF_EVENT_IOC_ENABLE, 0);
+   }
+   pthread_barrier_wait(&start_barrier);
+   start = now_ns();
+   res.calls = 0;
+   for (int x = 0; x < nthreads; x++){
+      pthread_join(w[x].tid, NULL);
+      res.calls += w[x].calls;
+   }
+   res.elapsed = now_ns() - start;
+   for (int x = 0; x < NO_COUNTERS; x++){
+      uint64_t count;
+      res.counters[x] = -1;
+      if (perf_fd[x] < 0)
+         continue;
+      ioctl(perf_fd[x], PERF_EVENT_IOC_DISABLE, 0);
+      if (read(perf_fd[x], &count, sizeof(count)) == sizeof(count))
+         res.counters[x] = count;
+      close(perf_fd[x]);
+   }
+   res.footprint = alloc->footprint();
+
+   if (wl->cleanup != NULL)
+      wl->cleanup(nthreads);
+   if (write(fd, &res, sizeof(res)) != sizeof(res))
+      _exit(1);
+}
+
+/*
+ * worker_main - Waits for the other threads, then runs the workload.
+ */
+static void *worker_main(void *arg)
+{
+   struct worker *w = arg;
+   w->calls = 0;
+   pthread_barrier_wait(&start_barrier);
+   current->run(w);
+   return NULL;
+}
+
+/*
+ * larson_setup - Fills the slots of every thread from the main thread, so
+ * that the first frees of each thread are of foreign blocks.
+ */
+static void larson_setup(int nthreads)
+{
+   uint64_t s = seed;
+   size_t n = (size_t)nthreads * LARSON_SLOTS;
+
+   larson_slots = calloc(n, sizeof(void *));
+   larson_sizes = calloc(n, sizeof(size_t));
+   if (!larson_slots || !larson_sizes){
+      fprintf(stderr, "out of memory\n");
+      _exit(1);
+   }
+   for (size_t x = 0; x < n; x++){
+      larson_sizes[x] = 8 + next_rand(&s) % 993;
+      larson_slots[x] = checked(alloc->malloc(larson_sizes[x]));
+   }
+   pthread_barrier_init(&round_barrier, NULL, nthreads);
+}
+
+/*
+ * larson_run - Replaces random blocks in one thread's slots, a round at a
+ * time. Thread id works on the slots of thread id + round, the barrier
+ * between rounds hands every array on to the previous thread.
+ */
+static void larson_run(struct worker *w)
+{
+   long iters = MAX(calls_per_thread / 2, 1), done = 0;
+
+   for (int round = 0; done < iters; round++){
+      long end = MIN(iters, done + LARSON_ROUND);
+      size_t base = (size_t)((w->id + round) % nworkers) * LARSON_SLOTS;
+
+      for (; done < end; done++){
+         size_t x = base + next_rand(&w->seed) % LARSON_SLOTS;
+         alloc->free(larson_slots[x]);
+         larson_sizes[x] = 8 + next_rand(&w->seed) % 993;
+         larson_slots[x] = checked(alloc->malloc(larson_sizes[x]));
+         *(char *)larson_slots[x] = (char)x;
+      }
+      w->calls = 2 * done;
+      pthread_barrier_wait(&round_barrier);
+   }
+}
+
+static void larson_cleanup(int nthreads)
+{
+   for (size_t x = 0; x < (size_t)nthreads * LARSON_SLOTS; x++){
+      alloc->free(larson_slots[x]);
+   }
+   free(larson_slots);
+   free(larson_sizes);
+   pthread_barrier_destroy(&round_barrier);
+}
+
+/*
+ * thread_run - Allocates and frees batches of equal blocks.
+ */
+static void thread_run(struct worker *w)
+{
+   void *batch[BATCH];
+   long rounds = MAX(calls_per_thread / (2 * BATCH), 1);
+
+   for (long r = 0; r < rounds; r++){
+      for (int x = 0; x < BATCH; x++){
+         batch[x] = checked(alloc->malloc(BATCH_SIZE));
+         *(char *)batch[x] = (char)x;
+      }
+      for (int x = 0; x < BATCH; x++){
+         alloc->free(batch[x]);
+      }
+   }
+   w->calls = rounds * 2 * BATCH;
+}
+
+static void prodcons_setup(int nthreads)
+{
+   if (posix_memalign((void **)&rings, 64, nthreads * sizeof(struct ring))){
+      fprintf(stderr, "out of memory\n");
+      _exit(1);
+   }
+   memset(rings, 0, nthreads * sizeof(struct ring));
+}
+
+/*
+ * prodcons_run - Allocates blocks into the ring of this thread and frees
+ * the blocks the previous thread put in its ring. Once done allocating the
+ * thread keeps freeing until the previous thread is done as well and its
+ * ring is empty. A lone thread frees its own blocks.
+ */
+static void prodcons_run(struct worker *w)
+{
+   struct ring *out = &rings[w->id];
+   struct ring *in = &rings[(w->id + nworkers - 1) % nworkers];
+   long produce = MAX(calls_per_thread / 2, 1);
+
+   for (long x = 0; x < produce; x++){
+      void *p = checked(alloc->malloc(rand_size(&w->seed, 16, 4096)));
+      *(char *)p = (char)x;
+      w->calls++;
+      while (out->head - __atomic_load_n(&out->tail, __ATOMIC_ACQUIRE) ==
+            RING_SIZE){
+         if (ring_pop_free(in))
+            w->calls++;
+         else
+            sched_yield();
+      }
+      out->slot[out->head % RING_SIZE] = p;
+      __atomic_store_n(&out->head, out->head + 1, __ATOMIC_RELEASE);
+      if (ring_pop_free(in))
+         w->calls++;
+   }
+   __atomic_store_n(&out->done, 1, __ATOMIC_RELEASE);
+
+   for (;;){
+      int done = __atomic_load_n(&in->done, __ATOMIC_ACQUIRE);
+      if (ring_pop_free(in))
+         w->calls++;
+      else if (done)
+         break;
+      else
+         sched_yield();
+   }
+}
+
+/*
+ * ring_pop_free - Frees the oldest block in ring r. Returns 0 if the ring
+ * was empty. Only the thread after the ring's owner calls this.
+ */
+static int ring_pop_free(struct ring *r)
+{
+   unsigned long tail = r->tail;
+   void *p;
+
+   if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+      return 0;
+   p = r->slot[tail % RING_SIZE];
+   __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+   alloc->free(p);
+   return 1;
+}
+
+/*
+ * realloc_run - Grows random buffers by half again, writing their last
+ * byte, and frees the ones past GROW_MAX.
+ */
+static void realloc_run(struct worker *w)
+{
+   void *buf[GROW_SLOTS] = {NULL};
+   size_t size[GROW_SLOTS];
+
+   while (w->calls < calls_per_thread){
+      int x = next_rand(&w->seed) % GROW_SLOTS;
+      if (buf[x] == NULL){
+         size[x] = rand_size(&w->seed, 16, 64);
+         buf[x] = checked(alloc->malloc(size[x]));
+      }
+      else if (size[x] > GROW_MAX){
+         alloc->free(buf[x]);
+         buf[x] = NULL;
+      }
+      else{
+         size[x] += size[x] / 2 + 16;
+         buf[x] = checked(alloc->realloc(buf[x], size[x]));
+      }
+      if (buf[x] != NULL)
+         ((char *)buf[x])[size[x] - 1] = (char)x;
+      w->calls++;
+   }
+   for (int x = 0; x < GROW_SLOTS; x++){
+      if (buf[x] != NULL){
+         alloc->free(buf[x]);
+         w->calls++;
+      }
+   }
+}
+
+static void proxy_setup(int nthreads)
+{
+   (void)nthreads;
+   cache_lru.next = cache_lru.prev = &cache_lru;
+   cache_bytes = 0;
+}
+
+/*
+ * proxy_run - Serves requests for urls of skewed popularity. A miss reads a
+ * response of up to twice MAX_OBJECT_SIZE into a buffer of MAX_OBJECT_SIZE,
+ * touching each of its pages, and caches it if it fits.
+ */
+static void proxy_run(struct worker *w)
+{
+   char *headers[NO_HEADERS];
+
+   while (w->calls < calls_per_thread){
+      int *connfd = checked(alloc->malloc(sizeof(int)));
+      char *line = checked(alloc->malloc(MAXLINE));
+      unsigned url = rand_size(&w->seed, 1, NO_URLS + 1) - 1;
+
+      *connfd = w->id;
+      line[0] = '\0';
+      w->calls += 2;
+      for (int x = 0; x < NO_HEADERS; x++){
+         size_t len = rand_size(&w->seed, 32, 256);
+         headers[x] = checked(alloc->malloc(len));
+         memset(headers[x], 'h', len);
+         w->calls++;
+      }
+
+      if (!cache_hit(url)){
+         char *buf = checked(alloc->malloc(MAX_OBJECT_SIZE));
+         size_t size = rand_size(&w->seed, 512, 2 * MAX_OBJECT_SIZE);
+         for (size_t off = 0; off < MIN(size, MAX_OBJECT_SIZE); off += 4096){
+            buf[off] = (char)off;
+         }
+         w->calls++;
+         if (size <= MAX_OBJECT_SIZE){
+            buf = checked(alloc->realloc(buf, size));
+            w->calls += 1 + cache_insert(url, buf, size);
+         }
+         else{
+            alloc->free(buf);
+            w->calls++;
+         }
+      }
+
+      for (int x = 0; x < NO_HEADERS; x++){
+         alloc->free(headers[x]);
+      }
+      alloc->free(line);
+      alloc->free(connfd);
+      w->calls += NO_HEADERS + 2;
+   }
+}
+
+static void proxy_cleanup(int nthreads)
+{
+   (void)nthreads;
+   while (cache_lru.next != &cache_lru){
+      struct cache_entry *e = cache_lru.next;
+      lru_unlink(e);
+      alloc->free(e->buf);
+      alloc->free(e);
+   }
+}
+
+/*
+ * cache_insert - Caches response buf of url, evicting the least recently
+ * used responses until it fits. buf is freed instead if another thread
+ * cached url first. Returns the allocator calls made.
+ */
+static int cache_insert(unsigned url, char *buf, size_t size)
+{
+   int calls = 0;
+
+   pthread_mutex_lock(&cache_lock);
+   if (cache_urls[url] != NULL){
+      pthread_mutex_unlock(&cache_lock);
+      alloc->free(buf);
+      return 1;
+   }
+   while (cache_bytes + size > MAX_CACHE_SIZE && cache_lru.prev != &cache_lru){
+      struct cache_entry *victim = cache_lru.prev;
+      lru_unlink(victim);
+      cache_urls[victim->url] = NULL;
+      cache_bytes -= victim->size;
+      alloc->free(victim->buf);
+      alloc->free(victim);
+      calls += 2;
+   }
+   struct cache_entry *e = checked(alloc->malloc(sizeof(*e)));
+   e->url = url;
+   e->size = size;
+   e->buf = buf;
+   cache_urls[url] = e;
+   cache_bytes += size;
+   lru_push(e);
+   pthread_mutex_unlock(&cache_lock);
+   return calls + 1;
+}
+
+/*
+ * cache_hit - Marks url as recently used if it is cached. Returns 1 on a hit.
+ */
+static int cache_hit(unsigned url)
+{
+   struct cache_entry *e;
+
+   pthread_mutex_lock(&cache_lock);
+   if ((e = cache_urls[url]) != NULL){
+      lru_unlink(e);
+      lru_push(e);
+   }
+   pthread_mutex_unlock(&cache_lock);
+   return e != NULL;
+}
+
+static void lru_unlink(struct cache_entry *e)
+{
+   e->prev->next = e->next;
+   e->next->prev = e->prev;
+}
+
+static void lru_push(struct cache_entry *e)
+{
+   e->next = cache_lru.next;
+   e->prev = &cache_lru;
+   cache_lru.next->prev = e;
+   cache_lru.next = e;
+}
+
+/*
+ * checked - Returns p, or exits the run if an allocation failed.
+ */
+static void *checked(void *p)
+{
+   if (p == NULL){
+      fprintf(stderr, "%s: allocation failed\n", current->name);
+      _exit(1);
+   }
+   return p;
+}
+
+/*
+ * perf_open - Opens hardware counter x of counter_defs for this process and
+ * the threads it creates from now on, disabled and counting user mode only.
+ * Returns -1 if it is not available.
+ */
+static int perf_open(int x)
+{
+   struct perf_event_attr attr;
+
+   memset(&attr, 0, sizeof(attr));
+   attr.size = sizeof(attr);
+   attr.type = counter_defs[x].type;
+   attr.config = counter_defs[x].config;
+   attr.disabled = 1;
+   attr.inherit = 1;
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+   return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static size_t mm_footprint(void)
+{
+   struct mm_stats st;
+   mm_stats(&st);
+   return st.heap_size + st.mapped_bytes;
+}
+
+static size_t libc_footprint(void)
+{
+   struct mallinfo2 mi = mallinfo2();
+   return mi.arena + mi.hblkhd;
+}
+
+/*
+ * next_rand - xorshift64*, cheap enough not to show in the calls timed.
+ */
+static uint64_t next_rand(uint64_t *s)
+{
+   *s ^= *s >> 12;
+   *s ^= *s << 25;
+   *s ^= *s >> 27;
+   return *s * 0x2545f4914f6cdd1dULL;
+}
+
+/*
+ * rand_size - Returns a size drawn log-uniformly from lo up to below hi.
+ */
+static size_t rand_size(uint64_t *s, size_t lo, size_t hi)
+{
+   int a = 63 - __builtin_clzll(lo), b = 63 - __builtin_clzll(hi);
+   int shift = a + (b > a ? (int)(next_rand(s) % (b - a)) : 0);
+   size_t x = ((size_t)1 << shift) + next_rand(s) % ((size_t)1 << shift);
+   return x < lo ? lo : x >= hi ? hi - 1 : x;
+}
+
+/*
+ * now_ns - Monotonic clock in nanoseconds.
+ */
+static long now_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void usage(const char *prog)
+{
+   fprintf(stderr, "usage: %s [-a mm|libc] [-w larson|thread|prodcons|"
+         "realloc|proxy] [-t threads] [-n calls] [-s seed]\n", prog);
+   exit(1);
+}
@@ -0,0 +1,347 @@
+/*
+ * mm_trace.c
+ *
+ * Records the malloc, free, realloc, calloc, memalign, posix_memalign and
+ * aligned_alloc calls of a process into a binary trace (see mm_trace.h) for
+ * mm_replay.c. It is preloaded into the process and passes every call on to
+ * the next allocator, normally the C library's:
+ *
+ *   gcc -O2 -shared -fPIC -o mm_trace.so mm_trace.c -ldl -lpthread
+ *   MM_TRACE=/tmp/app.trace LD_PRELOAD=./mm_trace.so ./app
+ *
+ * Each process writes to MM_TRACE with its pid appended, so children that
+ * inherit the preload get traces of their own. Calls are recorded under a
+ * single lock held across the real call, which keeps the record order
+ * consistent with the addresses handed out at the cost of serializing the
+ * allocator of a multithreaded process while tracing.
+ *
+ * valloc and pvalloc are not intercepted. Blocks they return are unknown to
+ * the replay, which skips their frees like those of blocks allocated before
+ * tracing started.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mm_trace.h"
+
+/* Records buffered before each write */
+#define TRACE_BUF 4096
+
+/* Memory handed out while dlsym is still looking up the real allocator */
+#define BOOT_SIZE 4096
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+
+static void *(*real_malloc)(size_t);
+static void (*real_free)(void *);
+static void *(*real_realloc)(void *, size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_memalign)(size_t, size_t);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mm_trace_rec trace_buf[TRACE_BUF];
+static int trace_count;
+static int trace_fd = -1;
+
+static char boot_heap[BOOT_SIZE] __attribute__((aligned(16)));
+static size_t boot_used;
+
+/* Set while a thread is inside the recorder, its calls are not traced */
+static __thread int in_trace;
+
+/* Function prototypes */
+static void trace_init(void) __attribute__((constructor));
+static void trace_fini(void) __attribute__((destructor));
+static void trace_open(void);
+static void trace_flush(void);
+static void trace_put(int op, size_t size, void *ptr, void *result);
+static void *boot_alloc(size_t size);
+static void trace_prepare(void);
+static void trace_parent(void);
+static void trace_child(void);
+
+/*
+ * trace_init - Looks up the real allocator and opens the trace.
+ */
+static void trace_init(void)
+{
+   if (real_malloc != NULL)
+      return;
+   in_trace = 1;
+   real_malloc = dlsym(RTLD_NEXT, "malloc");
+   real_free = dlsym(RTLD_NEXT, "free");
+   real_realloc = dlsym(RTLD_NEXT, "realloc");
+   real_calloc = dlsym(RTLD_NEXT, "calloc");
+   real_memalign = dlsym(RTLD_NEXT, "memalign");
+   real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+   real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+   trace_open();
+   pthread_atfork(trace_prepare, trace_parent, trace_child);
+   in_trace = 0;
+}
+
+/*
+ * trace_fini - Writes out the records still buffered at exit.
+ */
+static void trace_fini(void)
+{
+   pthread_mutex_lock(&trace_lock);
+   trace_flush();
+   pthread_mutex_unlock(&trace_lock);
+}
+
+/*
+ * trace_open - Creates the trace file of the current process and writes its
+ * header. Tracing is off if MM_TRACE is not set or the file can not be
+ * created.
+ */
+static void trace_open(void)
+{
+   const char *path = getenv("MM_TRACE");
+   char name[4096];
+   struct mm_trace_header hdr;
+
+   trace_fd = -1;
+   trace_count = 0;
+   if (path == NULL)
+      return;
+   snprintf(name, sizeof(name), "%s.%d", path, (int)getpid());
+   if ((trace_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+      return;
+   hdr.magic = MM_TRACE_MAGIC;
+   hdr.pid = getpid();
+   if (write(trace_fd, &hdr, sizeof(hdr)) != sizeof(hdr)){
+      close(trace_fd);
+      trace_fd = -1;
+   }
+}
+
+/*
+ * trace_flush - Writes the buffered records. Caller must hold the trace lock.
+ */
+static void trace_flush(void)
+{
+   size_t len = trace_count * sizeof(struct mm_trace_rec);
+   char *p = (char *)trace_buf;
+   ssize_t n;
+
+   while (trace_fd >= 0 && len > 0){
+      if ((n = write(trace_fd, p, len)) <= 0)
+         break;
+      p += n;
+      len -= n;
+   }
+   trace_count = 0;
+}
+
+/*
+ * trace_put - Appends a record. Caller must hold the trace lock.
+ */
+static void trace_put(int op, size_t size, void *ptr, void *result)
+{
+   struct mm_trace_rec *rec;
+   if (trace_fd < 0)
+      return;
+   rec = &trace_buf[trace_count++];
+   rec->op_size = MM_TRACE_PACK(op, size);
+   rec->ptr = (uint64_t)(uintptr_t)ptr;
+   rec->result = (uint64_t)(uintptr_t)result;
+   if (trace_count == TRACE_BUF)
+      trace_flush();
+}
+
+/*
+ * boot_alloc - Serves the allocations dlsym makes before the real allocator
+ * is known. This memory is never freed.
+ */
+static void *boot_alloc(size_t size)
+{
+   void *p;
+   size = (size + 15) & ~(size_t)15;
+   if (boot_used + size > BOOT_SIZE)
+      return NULL;
+   p = boot_heap + boot_used;
+   boot_used += size;
+   return p;
+}
+
+/*
+ * trace_prepare, trace_parent, trace_child - Fork handlers. The parent's
+ * records are written before the fork so that the child does not repeat
+ * them, and the child starts a trace of its own.
+ */
+static void trace_prepare(void)
+{
+   pthread_mutex_lock(&trace_lock);
+   trace_flush();
+}
+
+static void trace_parent(void)
+{
+   pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_child(void)
+{
+   in_trace = 1;
+   if (trace_fd >= 0)
+      close(trace_fd);
+   trace_open();
+   pthread_mutex_init(&trace_lock, NULL);
+   in_trace = 0;
+}
+
+void *malloc(size_t size)
+{
+   void *p;
+   if (real_malloc == NULL && !in_trace)
+      trace_init();
+   if (real_malloc == NULL)
+      return boot_alloc(size);
+   if (in_trace)
+      return real_malloc(size);
+
+   in_trace = 1;
+   pthread_mutex_lock(&trace_lock);
+   p = real_malloc(size);
+   trace_put(MM_TRACE_MALLOC, size, NULL, p);
+   pthread_mutex_unlock(&trace_lock);
+   in_trace = 0;
+   return p;
+}
+
+void free(void *ptr)
+{
+   if (ptr == NULL)
+      return;
+   if ((char *)ptr >= boot_heap && (char *)ptr < boot_heap + BOOT_SIZE)
+      return;
+   if (in_trace){
+      real_free(ptr);
+      return;
+   }
+
+   in_trace = 1;
+   pthread_mutex_lock(&trace_lock);
+   real_free(ptr);
+   trace_put(MM_TRACE_FREE, 0, ptr, NULL);
+   pthread_mutex_unlock(&trace_lock);
+   in_trace = 0;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+   void *p;
+   if (real_realloc == NULL && !in_trace)
+      trace_init();
+   if ((char *)ptr >= boot_heap && (char *)ptr < boot_heap + BOOT_SIZE){
+      /* Move out of the boot heap, the old size is unknown but bounded */
+      if ((p = malloc(size)) != NULL)
+         memcpy(p, ptr,
+               MIN(size, (size_t)(boot_heap + BOOT_SIZE - (char *)ptr)));
+      return p;
+   }
+   if (real_realloc == NULL)
+      return NULL;
+   if (in_trace)
+      return real_realloc(ptr, size);
+
+   in_trace = 1;
+   pthread_mutex_lock(&trace_lock);
+   p = real_realloc(ptr, size);
+   trace_put(MM_TRACE_REALLOC, size, ptr, p);
+   pthread_mutex_unlock(&trace_lock);
+   in_trace = 0;
+   return p;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+   void *p;
+   size_t bytes;
+   if (real_calloc == NULL && !in_trace)
+      trace_init();
+   if (real_calloc == NULL){
+      if (__builtin_mul_overflow(nmemb, size, &bytes))
+         return NULL;
+      /* The boot heap is static and still zero */
+      return boot_alloc(bytes);
+   }
+   if (in_trace)
+      return real_calloc(nmemb, size);
+
+   in_trace = 1;
+   pthread_mutex_lock(&trace_lock);
+   p = real_calloc(nmemb, size);
+   if (!__builtin_mul_overflow(nmemb, size, &bytes))
+      trace_put(MM_TRACE_CALLOC, bytes, NULL, p);
+   pthread_mutex_unlock(&trace_lock);
+   in_trace = 0;
+   return p;
+}
+
+void *memalign(size_t align, size_t size)
+{
+   void *p;
+   if (real_memalign == NULL && !in_trace)
+      trace_init();
+   if (real_memalign == NULL)
+      return NULL;
+   if (in_trace)
+      return real_memalign(align, size);
+
+   in_trace = 1;
+   pthread_mutex_lock(&trace_lock);
+   p = real_memalign(align, size);
+   trace_put(MM_TRACE_MEMALIGN, size, (void *)align, p);
+   pthread_mutex_unlock(&trace_lock);
+   in_trace = 0;
+   return p;
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+   int err;
+   if (real_posix_memalign == NULL && !in_trace)
+      trace_init();
+   if (real_posix_memalign == NULL)
+      return ENOMEM;
+   if (in_trace)
+      return real_posix_memalign(memptr, align, size);
+
+   in_trace = 1;
+   pthread_mutex_lock(&trace_lock);
+   err = real_posix_memalign(memptr, align, size);
+   trace_put(MM_TRACE_MEMALIGN, size, (void *)align, err ? NULL : *memptr);
+   pthread_mutex_unlock(&trace_lock);
+   in_trace = 0;
+   return err;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+   void *p;
+   if (real_aligned_alloc == NULL && !in_trace)
+      trace_init();
+   if (real_aligned_alloc == NULL)
+      return NULL;
+   if (in_trace)
+      return real_aligned_alloc(align, size);
+
+   in_trace = 1;
+   pthread_mutex_lock(&trace_lock);
+   p = real_aligned_alloc(align, size);
+   trace_put(MM_TRACE_MEMALIGN, size, (void *)align, p);
+   pthread_mutex_unlock(&trace_lock);
+   in_trace = 0;
+   return p;
+}
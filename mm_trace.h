@@ -0,0 +1,45 @@
+/*
+ * mm_trace.h
+ *
+ * Binary trace format shared by the mm_trace.c recorder and the mm_replay.c
+ * driver. A trace is a header followed by fixed size records, one for each
+ * call in the order the calls completed. Pointers are recorded as the
+ * traced process saw them, the replay driver maps them to its own blocks.
+ */
+
+#ifndef MM_TRACE_H
+#define MM_TRACE_H
+
+#include <stdint.h>
+
+#define MM_TRACE_MAGIC 0x31434152544d4dULL   /* "MMTRAC1" */
+
+/* Operation kinds */
+#define MM_TRACE_MALLOC 1
+#define MM_TRACE_FREE 2
+#define MM_TRACE_REALLOC 3
+#define MM_TRACE_CALLOC 4
+#define MM_TRACE_MEMALIGN 5   /* also posix_memalign and aligned_alloc */
+
+/* The size and the operation share a word, sizes are below 2^56 */
+#define MM_TRACE_OP_SHIFT 56
+#define MM_TRACE_PACK(op, size) \
+   (((uint64_t)(op) << MM_TRACE_OP_SHIFT) | (uint64_t)(size))
+#define MM_TRACE_OP(word) ((int)((word) >> MM_TRACE_OP_SHIFT))
+#define MM_TRACE_SIZE(word) ((word) & (((uint64_t)1 << MM_TRACE_OP_SHIFT) - 1))
+
+struct mm_trace_header {
+   uint64_t magic;
+   uint64_t pid;
+};
+
+/* One call. ptr is the argument of free and realloc and the alignment of
+ * memalign, result the pointer returned by the allocating calls. calloc
+ * records nmemb * size. */
+struct mm_trace_rec {
+   uint64_t op_size;
+   uint64_t ptr;
+   uint64_t result;
+};
+
+#endif /* MM_TRACE_H */